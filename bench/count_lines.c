@@ -0,0 +1,158 @@
+/*
+ * count_lines: cross-checks and times scriptsort's newline kernels.
+ *
+ * Every kernel this CPU supports (SWAR, SSE2, AVX2, AVX-512BW, and the
+ * dispatched count_newlines()) is first compared against a byte-at-a-time
+ * count at random lengths and alignments, then timed on a few buffer sizes.
+ * Links against src/newlines.c, the same kernels scriptsort is built with.
+ *
+ * Usage: count_lines [seed] [checks]
+ * Built by build.sh; exits non-zero if any kernel disagrees.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/newlines.h"
+
+#define SGR_RED   "\033[31m"
+#define SGR_RESET "\033[22;39m"
+
+#define BENCH_BUFFER_SIZE (1u << 20)
+#define BENCH_ALIGN_SLACK 64
+#define BENCH_TIME_BYTES  (1ull << 30)  /* bytes scanned per timing */
+
+typedef struct {
+  const char     *name;
+  NewlineCounter  fn;
+  int             supported;
+} Kernel;
+
+/* The reference every kernel must agree with. */
+static size_t count_newlines_bytes(const char *p, size_t n) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++)
+    if (p[i] == '\n') count++;
+  return count;
+}
+
+/* xorshift64*, so a seed reproduces a failing run on any libc. */
+static uint64_t bench_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Fills buf with one newline per `every` bytes on average; every == 1
+ * makes it all newlines, which drives the byte counters of the SSE2 and
+ * AVX2 kernels to the 255 fold limit.
+ */
+static void fill_buffer(char *buf, size_t size, unsigned int every, uint64_t *state) {
+  for (size_t i = 0; i < size; i++) {
+    uint64_t r     = bench_random(state);
+    char     other = (char)(r >> 32);
+    buf[i] = (r % every == 0) ? '\n' : (other == '\n' ? 'x' : other);
+  }
+}
+
+static double elapsed_ns(const struct timespec *a, const struct timespec *b) {
+  return (double)(b->tv_sec - a->tv_sec) * 1e9 + (double)(b->tv_nsec - a->tv_nsec);
+}
+
+int main(int argc, char **argv) {
+  uint64_t     seed   = argc > 1 ? strtoull(argv[1], NULL, 0) : (uint64_t)time(NULL);
+  unsigned int checks = argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 0) : 20000;
+  uint64_t     state  = seed | 1;
+  int          failed = 0;
+
+  Kernel kernels[] = {
+    { "swar",     count_newlines_swar,   1 },
+#ifdef SCRIPTSORT_X86_SIMD
+    { "sse2",     count_newlines_sse2,   1 },
+    { "avx2",     count_newlines_avx2,   0 },
+    { "avx512bw", count_newlines_avx512, 0 },
+#endif
+    { "dispatch", count_newlines,        1 },
+  };
+  size_t kernel_count = sizeof(kernels) / sizeof(kernels[0]);
+
+#ifdef SCRIPTSORT_X86_SIMD
+  /* The same checks select_newline_counter() makes before using a kernel */
+  __builtin_cpu_init();
+  kernels[2].supported = __builtin_cpu_supports("avx2") ? 1 : 0;
+  kernels[3].supported = __builtin_cpu_supports("avx512bw") ? 1 : 0;
+#endif
+
+  char *buf = malloc(BENCH_BUFFER_SIZE + BENCH_ALIGN_SLACK);
+  if (!buf) {
+    fprintf(stderr, "count_lines: out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("seed %llu, %u checks per kernel\n", (unsigned long long)seed, checks);
+  for (size_t k = 0; k < kernel_count; k++)
+    if (!kernels[k].supported) printf("%-9s skipped: not supported by this CPU\n", kernels[k].name);
+
+  /* Cross-check: random density, start offset and length, biased towards
+   * short lengths where the tails and alignment matter most */
+  static const unsigned int densities[] = { 1, 2, 16, 40, 255, 100000 };
+  for (unsigned int c = 0; c < checks && !failed; c++) {
+    if (c % 500 == 0)
+      fill_buffer(buf, BENCH_BUFFER_SIZE + BENCH_ALIGN_SLACK,
+                  densities[(c / 500) % (sizeof(densities) / sizeof(densities[0]))], &state);
+
+    size_t offset = bench_random(&state) % BENCH_ALIGN_SLACK;
+    size_t limit  = (c % 4 == 0) ? BENCH_BUFFER_SIZE : (c % 4 == 1) ? 4096 : 160;
+    size_t length = bench_random(&state) % (limit + 1);
+    size_t expect = count_newlines_bytes(buf + offset, length);
+
+    for (size_t k = 0; k < kernel_count; k++) {
+      if (!kernels[k].supported) continue;
+      size_t got = kernels[k].fn(buf + offset, length);
+      if (got != expect) {
+        fprintf(stderr, SGR_RED "%s: %zu newlines instead of %zu at offset %zu, length %zu (seed %llu)\n" SGR_RESET,
+                kernels[k].name, got, expect, offset, length, (unsigned long long)seed);
+        failed = 1;
+      }
+    }
+  }
+  if (failed) {
+    free(buf);
+    return EXIT_FAILURE;
+  }
+  printf("all kernels agree with the byte-at-a-time count\n\n");
+
+  /* Timing: throughput on a script-like density, per buffer size */
+  static const size_t sizes[] = { 64, 1024, 64 * 1024, BENCH_BUFFER_SIZE };
+  fill_buffer(buf, BENCH_BUFFER_SIZE + BENCH_ALIGN_SLACK, 40, &state);
+
+  printf("%-9s", "GB/s");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) printf(" %10zu", sizes[s]);
+  printf("\n");
+
+  for (size_t k = 0; k < kernel_count; k++) {
+    if (!kernels[k].supported) continue;
+    printf("%-9s", kernels[k].name);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      size_t          rounds = (size_t)(BENCH_TIME_BYTES / sizes[s]);
+      volatile size_t sink   = 0;
+      struct timespec start, end;
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (size_t r = 0; r < rounds; r++)
+        sink += kernels[k].fn(buf + (r % BENCH_ALIGN_SLACK), sizes[s]);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      (void)sink;
+
+      printf(" %10.2f", (double)rounds * (double)sizes[s] / elapsed_ns(&start, &end));
+    }
+    printf("\n");
+  }
+
+  free(buf);
+  return EXIT_SUCCESS;
+}
@@ -1,5 +1,6 @@
 #!/usr/bin/env sh
 
-gcc -o .local/bin/scriptsort src/scriptsort.c
+gcc -pthread -o .local/bin/scriptsort src/scriptsort.c src/newlines.c
 gcc -o .local/bin/ms src/ms.c
+gcc -O2 -o bench/count_lines bench/count_lines.c src/newlines.c
 
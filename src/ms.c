@@ -9,15 +9,10 @@
 #include <time.h>
 
 int main() {
-  time_t now;
-  struct tm *timeinfo;
-  char buffer[80];
+  struct timespec now;
 
-  time(&now);
-  timeinfo = localtime(&now);
-
-  strftime(buffer, sizeof(buffer), "%s", timeinfo);
-  printf("%s000\n", buffer);
+  if (clock_gettime(CLOCK_REALTIME, &now) != 0) return 1;
+  printf("%lld\n", (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
 
   return 0;
 }
@@ -0,0 +1,120 @@
+/**
+ * newlines.c
+ *
+ * count_lines() runs over every bundled byte, so the '\n' scan has a
+ * vector kernel per x86-64 ISA level, picked once at runtime from cpuid,
+ * and a word-at-a-time fallback for everything else and for tails.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "newlines.h"
+
+#ifdef SCRIPTSORT_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Newline-counting kernel, resolved from cpuid on first use */
+static NewlineCounter newline_counter = NULL;
+
+/* Counts '\n' bytes eight at a time with plain 64-bit arithmetic. */
+size_t count_newlines_swar(const char *p, size_t n) {
+  const uint64_t ones  = 0x0101010101010101ULL;
+  const uint64_t lows  = 0x7f7f7f7f7f7f7f7fULL;
+  size_t         count = 0;
+  size_t         i     = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, sizeof(w));
+    w ^= ones * '\n';                               /* newline bytes → 0 */
+    uint64_t t = ((w & lows) + lows) | w;           /* high bit set unless 0 */
+    count += (((~t & ~lows) >> 7) * ones) >> 56;    /* sum of the zero flags */
+  }
+  for (; i < n; i++)
+    if (p[i] == '\n') count++;
+  return count;
+}
+
+#ifdef SCRIPTSORT_X86_SIMD
+
+/*
+ * The SSE2 and AVX2 kernels subtract each compare mask (0 or -1 per byte)
+ * from byte-wide counters and fold them with psadbw every 255 vectors,
+ * before any counter can wrap.
+ */
+size_t count_newlines_sse2(const char *p, size_t n) {
+  const __m128i nl    = _mm_set1_epi8('\n');
+  size_t        count = 0;
+  size_t        i     = 0;
+
+  while (n - i >= 16) {
+    size_t  blocks = (n - i) / 16;
+    __m128i acc    = _mm_setzero_si128();
+    if (blocks > 255) blocks = 255;
+
+    for (size_t b = 0; b < blocks; b++, i += 16)
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl));
+
+    __m128i sums = _mm_sad_epu8(acc, _mm_setzero_si128());
+    count += (size_t)_mm_cvtsi128_si64(sums) + (size_t)_mm_extract_epi16(sums, 4);
+  }
+  return count + count_newlines_swar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+size_t count_newlines_avx2(const char *p, size_t n) {
+  const __m256i nl    = _mm256_set1_epi8('\n');
+  size_t        count = 0;
+  size_t        i     = 0;
+
+  while (n - i >= 32) {
+    size_t  blocks = (n - i) / 32;
+    __m256i acc    = _mm256_setzero_si256();
+    if (blocks > 255) blocks = 255;
+
+    for (size_t b = 0; b < blocks; b++, i += 32)
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl));
+
+    __m256i sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+    count += (size_t)_mm256_extract_epi64(sums, 0) + (size_t)_mm256_extract_epi64(sums, 1) +
+             (size_t)_mm256_extract_epi64(sums, 2) + (size_t)_mm256_extract_epi64(sums, 3);
+  }
+  return count + count_newlines_sse2(p + i, n - i);
+}
+
+/* AVX-512BW compares straight into a 64-bit mask, so a popcount suffices. */
+__attribute__((target("avx512f,avx512bw,popcnt")))
+size_t count_newlines_avx512(const char *p, size_t n) {
+  const __m512i nl    = _mm512_set1_epi8('\n');
+  size_t        count = 0;
+  size_t        i     = 0;
+
+  for (; i + 64 <= n; i += 64)
+    count += (size_t)__builtin_popcountll(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512(p + i), nl));
+  return count + count_newlines_sse2(p + i, n - i);
+}
+
+#endif /* SCRIPTSORT_X86_SIMD */
+
+/* Picks the widest kernel this CPU and OS support. */
+static NewlineCounter select_newline_counter(void) {
+#ifdef SCRIPTSORT_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw")) return count_newlines_avx512;
+  if (__builtin_cpu_supports("avx2"))     return count_newlines_avx2;
+  return count_newlines_sse2;
+#else
+  return count_newlines_swar;
+#endif
+}
+
+size_t count_newlines(const char *p, size_t n) {
+  NewlineCounter fn = __atomic_load_n(&newline_counter, __ATOMIC_RELAXED);
+  if (!fn) {
+    fn = select_newline_counter();
+    __atomic_store_n(&newline_counter, fn, __ATOMIC_RELAXED);
+  }
+  return fn(p, n);
+}
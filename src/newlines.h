@@ -0,0 +1,31 @@
+/**
+ * newlines.h
+ *
+ * '\n' counting kernels shared by scriptsort and bench/count_lines: a
+ * word-at-a-time fallback and, on x86-64, SSE2/AVX2/AVX-512BW kernels
+ * picked once at runtime from cpuid by count_newlines().
+ */
+
+#ifndef SCRIPTSORT_NEWLINES_H
+#define SCRIPTSORT_NEWLINES_H
+
+#include <stddef.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SCRIPTSORT_X86_SIMD      /* runtime-dispatched SSE2/AVX2/AVX-512 */
+#endif
+
+typedef size_t (*NewlineCounter)(const char *p, size_t n);
+
+/** Counts '\n' bytes in p[0..n) with the best kernel this CPU supports. */
+size_t count_newlines(const char *p, size_t n);
+
+/* The individual kernels; the vector ones must only run where cpuid says */
+size_t count_newlines_swar(const char *p, size_t n);
+#ifdef SCRIPTSORT_X86_SIMD
+size_t count_newlines_sse2(const char *p, size_t n);
+size_t count_newlines_avx2(const char *p, size_t n);
+size_t count_newlines_avx512(const char *p, size_t n);
+#endif
+
+#endif /* SCRIPTSORT_NEWLINES_H */
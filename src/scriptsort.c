@@ -11,26 +11,70 @@
  *   3. ordered.(50+).*    upper-numbered files, ascending
  */
 
+#define _GNU_SOURCE              /* syscall(), getdents64 on Linux */
+#define _DARWIN_C_SOURCE         /* DT_* constants on macOS */
 #define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/file.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#include "newlines.h"
 
 /* -------------------------------------------------------------------------
  * Constants
  * ---------------------------------------------------------------------- */
 
-#define SCRIPTSORT_VERSION   "2.1.0"
+#define SCRIPTSORT_VERSION   "2.2.0"
 
-#define MAX_FILES            1000
 #define MAX_FILENAME         256
-#define INITIAL_BUFFER_SIZE  4096
+#define INITIAL_INDEX_SIZE   64     /* FileEntry slots before first growth */
+#define INITIAL_NAMES_SIZE   2048   /* name arena bytes before first growth */
+#define INSERTION_SORT_MAX   16     /* runs at or below this skip qsort */
+#define DIRENT_BUFFER_SIZE   32768  /* bytes per getdents64 batch */
+#define EMIT_IOV_BATCH       64     /* segments gathered per writev() */
+#define EMIT_TEXT_SIZE       8192   /* generated text staged per batch */
+#define TRANSFER_CHUNK       65536  /* bounce buffer when zero-copy is refused */
+#define PREFETCH_WINDOW      16     /* minimum files loaded ahead of the emitter */
+#define MAX_JOBS             64     /* upper bound for --jobs */
+#define ZERO_COPY_MIN        16384  /* smaller bodies are cheaper to read() */
+#define MMAP_READ_MIN        65536  /* larger bodies are emitted from a mapping */
+#define CACHE_MAX_DIRS       3      /* watched directories per cache entry */
+#define MANIFEST_MAGIC       "scriptsort-manifest 2"
+
+/* Each bundled file's header; dir/name, its line range, lap call, dir/name, offset */
+#define BUNDLE_FILE_HEADER \
+  "\n# --- %s/%s (lines %d-%d) ---\n%s_SCRIPTSORT_FILE='%s/%s'\n_SCRIPTSORT_OFFSET=%d\n"
+#define FNV1A_OFFSET         0xcbf29ce484222325ULL
+#define FNV1A_PRIME          0x100000001b3ULL
+#define URING_BATCH          64     /* files per io_uring submission round */
+#define WATCH_DEBOUNCE_MS    50     /* quiet time before watch rebuilds */
+#define DAEMON_TIMEOUT_S     2      /* socket reads/writes give up after this */
 
 /* SGR / CSI color codes — description strings carry no SGR, renderer owns it */
 #define SGR_BOLD   "\033[1m"
@@ -53,6 +97,20 @@
 /* Edit subcommand operations */
 typedef enum { CMD_NONE, CMD_WRITE, CMD_APPEND, CMD_REMOVE } Command;
 
+/* How the emitter moves file bodies to its output fd */
+typedef enum {
+  TRANSFER_BUFFERED,    /* read into memory, then writev()              */
+  TRANSFER_SPLICE,      /* output is a pipe: splice() file → pipe        */
+  TRANSFER_COPY_RANGE,  /* output is a regular file: copy_file_range()  */
+  TRANSFER_SENDFILE     /* fallback when the above are refused          */
+} Transfer;
+
+/* File loading engines, selected with bundle --io */
+typedef enum {
+  ENGINE_SYNC,          /* openat/fstat/read/close per file             */
+  ENGINE_URING          /* batched through io_uring (Linux 5.6+)        */
+} Engine;
+
 /**
  * Flag definition — carries both matching data and help display text.
  * Description must be plain text; the renderer applies all SGR codes.
@@ -81,24 +139,237 @@ typedef unsigned char  Boolean;
 static const Boolean   Truth     = 1;
 static const Boolean   Falsehood = 0;
 
-/* File entry produced by directory scanning */
+/**
+ * File entry produced by directory scanning.
+ * The name itself lives in the owning SortedDir's arena; an entry only
+ * records where, so the index stays small and can be moved around freely
+ * while growing and sorting.
+ */
 typedef struct {
-  char         name[MAX_FILENAME];
+  size_t       name_off;     /* offset of the NUL-terminated name in names */
+  unsigned int name_len;
   int          order_num;    /* -1 for unordered files */
-  unsigned int bytesize;
+  unsigned int suffix_off;   /* start of the sort string within the name */
+  uint64_t     sort_prefix;  /* first 8 bytes of the sort string, big-endian */
 } FileEntry;
 
-/* Result of load_sorted_dir() */
+/**
+ * Result of load_sorted_dir(). Both the name arena and the entry index
+ * grow on demand, so there is no cap on directory size. Once sorted,
+ * entries are laid out as lower | unordered | upper.
+ */
 typedef struct {
-  FileEntry lower_files[MAX_FILES];
-  FileEntry upper_files[MAX_FILES];
-  FileEntry unordered_files[MAX_FILES];
-  int lower_count;
-  int upper_count;
-  int unordered_count;
-  int total_bytesize;   /* sum of (name_len + 2) across all entries */
+  int        dir_fd;           /* open directory, for *at() access; -1 if none */
+  char      *names;            /* packed, NUL-terminated filenames */
+  size_t     names_size;
+  size_t     names_capacity;
+  FileEntry *entries;
+  size_t     count;
+  size_t     capacity;
+  size_t     lower_count;
+  size_t     unordered_count;
+  size_t     upper_count;
+  size_t     total_bytesize;   /* sum of (name_len + 2) across all entries */
 } SortedDir;
 
+/**
+ * Gather-write output stream used by bundle. Generated text (preamble,
+ * per-file headers) is formatted into a small staging area while file
+ * bodies are queued by pointer; both go out together with one writev()
+ * per batch. Nothing is concatenated, and memory is bounded by the batch
+ * rather than by the total bundle size.
+ */
+typedef struct {
+  int          fd;
+  Transfer     transfer;               /* downgraded if the kernel refuses */
+  Boolean      stream;                 /* flush after every file (pipes)   */
+  struct iovec iov[EMIT_IOV_BATCH];
+  void        *owned[EMIT_IOV_BATCH];  /* released once the batch is written */
+  size_t       mapped[EMIT_IOV_BATCH]; /* nonzero: owned is an mmap of this size */
+  int          count;
+  char         text[EMIT_TEXT_SIZE];
+  size_t       text_used;
+  uint64_t     total;                  /* bytes emitted so far: next byte's offset */
+} Emitter;
+
+/* A directory contributing to a bundle, in output order */
+typedef struct {
+  char        path[PATH_MAX];
+  const char *label;      /* basename of path, shown in section headers */
+  int64_t     mtime_ns;   /* directory mtime before scanning, for the cache */
+  SortedDir   sd;
+} BundleSource;
+
+/* What a bundle contains; everything here is part of its cache key */
+typedef struct {
+  const char   *directory;     /* single-directory form, or NULL */
+  const char   *scripts_dir;   /* -s form, or NULL */
+  const char   *shell_subdir;  /* resolved shell sub-directory (-s only) */
+  unsigned int  cutoff;
+  Boolean       debug;
+} BundleSpec;
+
+/* One bundled file in a cache manifest: metadata plus where its body sits */
+typedef struct {
+  const char *name;
+  int         dir;        /* index of the file's directory (D line) */
+  uint64_t    ino;
+  uint64_t    size;
+  int64_t     mtime_ns;
+  uint64_t    offset;     /* body position in the bundle */
+  size_t      lines;
+  int64_t     reuse;      /* new entry: body offset in the old bundle, or -1 */
+} Segment;
+
+/* A parsed <key>.manifest; names point into text */
+typedef struct {
+  char       *text;
+  uint64_t    bundle_ino;
+  uint64_t    bundle_size;
+  const char *dirs[CACHE_MAX_DIRS];
+  int64_t     dir_mtimes[CACHE_MAX_DIRS];
+  int         dir_count;
+  Segment    *files;
+  size_t      file_count;
+} Manifest;
+
+/* One bundle variant a serve daemon answers for */
+typedef struct {
+  BundleSpec spec;
+  char       socket_path[PATH_MAX];
+  int        listen_fd;
+  char      *reply;                  /* 8-byte length, then the bundle */
+  size_t     reply_size;
+} ServeVariant;
+
+/* One file of a profile: the wrapper (index 0), a bundled file, or one
+ * sourced from outside the bundle */
+typedef struct {
+  char    *path;
+  int      first;          /* bundle lines of its body; 0 outside the bundle */
+  int      last;
+  int64_t  us;
+  size_t   commands;
+  size_t   external;       /* commands that ran a program from disk */
+} ProfileFile;
+
+/* One traced command */
+typedef struct {
+  int64_t  at;             /* start in epoch microseconds; hit count once folded */
+  int64_t  us;             /* until the next command started */
+  int      file;           /* index into files, -1 for the profiler's own */
+  int      line;           /* within that file */
+  int      bundle_line;    /* where the line sits in the bundle, 0 outside it */
+  char    *word;           /* first command word, or NULL */
+  char    *frames;         /* enclosing function calls, folded; NULL at top level */
+  Boolean  external;
+} ProfileHit;
+
+/* Everything scriptsort profile learns from one traced run */
+typedef struct {
+  ProfileFile *files;
+  size_t       file_count;
+  size_t       bundled;      /* files[0..bundled) come from the bundle */
+  ProfileHit  *hits;
+  size_t       hit_count;
+  size_t      *line_starts;  /* offset of each bundle line */
+  size_t       line_count;
+} ProfileReport;
+
+/* bundle --output destination while its replacement is being written */
+typedef struct {
+  const char *path;
+  char        temp_path[PATH_MAX];   /* "" once renamed or removed */
+} OutputFile;
+
+/* One bundle --cache entry being looked up or built */
+typedef struct {
+  char     dir[PATH_MAX];            /* ${XDG_CACHE_HOME:-$HOME/.cache}/scriptsort */
+  char     bundle_path[PATH_MAX];    /* <dir>/<key>.sh */
+  char     manifest_path[PATH_MAX];  /* <dir>/<key>.manifest */
+  char     lock_path[PATH_MAX];      /* <dir>/<key>.lock, held while rebuilding */
+  int      lock_fd;                  /* -1 unless the rebuild lock is held */
+  char     temp_path[PATH_MAX];      /* bundle being generated, "" if none */
+  char     base_path[PATH_MAX];      /* -s base directory, "" otherwise */
+  int64_t  base_mtime_ns;
+  int64_t  newest_dir_ns;            /* latest recorded directory mtime */
+  Manifest old;                      /* previous entry, when it can be reused */
+  int      old_fd;                   /* previous bundle, or -1 */
+  uint64_t seen_ino;                 /* bundle inode last looked up, 0 if none */
+  char    *dir_lines;                /* D lines for the new manifest */
+  size_t   dir_lines_len;
+  Segment *segments;                 /* one per bundled file, in bundle order */
+  size_t   segment_count;
+} BundleCache;
+
+/* One file to bundle: filled in by the loader, consumed in order */
+typedef struct {
+  const BundleSource *source;
+  const char         *name;
+  int                 fd;        /* zero-copy: open file, else -1 */
+  char               *contents;  /* buffered or mapped file bytes, else NULL */
+  size_t              size;
+  size_t              lines;
+  Boolean             mapped;    /* contents is a read-only mmap of size bytes */
+  Boolean             borrowed;  /* fd is the previous cached bundle; not ours */
+  off_t               offset;    /* where the body starts in fd */
+  unsigned int        syscalls;  /* sync engine: calls made loading it */
+  Boolean             ready;
+  Boolean             failed;
+} FileSlot;
+
+/* io_uring instance owned by one loader thread (defined with the engine) */
+typedef struct Uring Uring;
+
+/* How bundle_append_dirs() loads files */
+typedef struct {
+  int      jobs;
+  Engine   engine;
+  Boolean  readahead;   /* hint the whole file set to the kernel first */
+} LoadOptions;
+
+/* Counters reported by bundle --stats */
+typedef struct {
+  size_t         files;
+  size_t         bytes;
+  unsigned long  syscalls;     /* file-loading syscalls, not output writes */
+  Boolean        uring_used;   /* false if io_uring fell back to sync */
+  size_t         hinted;       /* files given a readahead hint */
+  size_t         failed;       /* files skipped because they could not be read */
+  size_t         reused;       /* bodies copied from the previous cached bundle */
+  const char    *cache;        /* bundle --cache outcome: off, hit or miss */
+} LoadStats;
+
+/* State shared between the emitter and its loader threads */
+typedef struct {
+  FileSlot        *slots;
+  size_t           count;
+  size_t           next_load;   /* next slot a loader will take */
+  size_t           consumed;    /* slots already emitted */
+  size_t           window;      /* how far loaders may run ahead */
+  Boolean          zero_copy;
+  Boolean          stop;
+  Engine           engine;
+  unsigned long    syscalls;    /* summed by loaders as they finish */
+  Boolean          uring_used;
+  size_t           hinted;      /* written by the readahead thread only */
+  pthread_t        threads[MAX_JOBS];
+  int              thread_count;
+  pthread_mutex_t  lock;
+  pthread_cond_t   cond;
+} Pipeline;
+
+/* One directory scan run on its own thread by scan_bundle_sources() */
+typedef struct {
+  BundleSource *source;
+  unsigned int  cutoff;
+  int           rc;
+} ScanJob;
+
+/* Name arena of the SortedDir currently being sorted; the qsort comparator
+ * receives only entries, so it resolves name offsets through this. */
+static const char *sort_names = NULL;
+
 /* -------------------------------------------------------------------------
  * Flag definitions — one NULL-terminated array per subcommand.
  * Add a new flag here; the generic renderer handles formatting.
@@ -117,6 +388,15 @@ static const FlagDef BUNDLE_FLAGS[] = {
   { NULL, "--bash",        NULL,        "override shell detection: use bash/ (requires -s)"     },
   { NULL, "--debug",       NULL,        "emit timing variables around the bundle"                },
   { NULL, "--cutoff",      "<n>",       "change the ordered file cutoff (default: 50)"           },
+  { "-j", "--jobs",        "<n>",       "load files with n parallel workers (default: 1)"        },
+  { NULL, "--io",          "<engine>",  "file loading engine: sync or uring (default: sync)"     },
+  { NULL, "--readahead",   NULL,        "ask the kernel to prefetch every file before reading"   },
+  { NULL, "--stats",       NULL,        "print load statistics and wall time to stderr"          },
+  { NULL, "--cache",       NULL,        "serve from and maintain an on-disk bundle cache"        },
+  { NULL, "--max-stale",   "<secs>",    "serve a cache validated within secs, revalidate behind" },
+  { NULL, "--refresh",     NULL,        "rebuild the cache now, reading every file"              },
+  { "-o", "--output",      "<file>",    "replace file atomically; untouched if nothing changed"  },
+  { NULL, "--no-daemon",   NULL,        "generate in-process even if a serve daemon is running"  },
   { NULL, NULL, NULL, NULL }
 };
 
@@ -127,6 +407,47 @@ static const FlagDef INIT_FLAGS[] = {
   { NULL, NULL, NULL, NULL }
 };
 
+static const FlagDef HOOK_FLAGS[] = {
+  { "-h", "--help",        NULL,        "show this help"                                        },
+  { "-s", "--scripts-dir", "<base-dir>","hook shared/ then the detected shell sub-directory"    },
+  { NULL, "--zsh",         NULL,        "override shell detection: use zsh/ (requires -s)"      },
+  { NULL, "--bash",        NULL,        "override shell detection: use bash/ (requires -s)"     },
+  { NULL, "--debug",       NULL,        "emit timing variables around the bundle"                },
+  { NULL, "--cutoff",      "<n>",       "change the ordered file cutoff (default: 50)"           },
+  { NULL, NULL, NULL, NULL }
+};
+
+static const FlagDef WATCH_FLAGS[] = {
+  { "-h", "--help",        NULL,        "show this help"                                        },
+  { "-s", "--scripts-dir", "<base-dir>","watch shared/, zsh/ and bash/ under base-dir"         },
+  { NULL, "--zsh",         NULL,        "only keep the zsh bundle up to date"                   },
+  { NULL, "--bash",        NULL,        "only keep the bash bundle up to date"                  },
+  { "-o", "--output",      "<file>",    "also write each bundle to file; {shell} names it"      },
+  { NULL, "--debug",       NULL,        "emit timing variables around the bundle"                },
+  { NULL, "--cutoff",      "<n>",       "change the ordered file cutoff (default: 50)"           },
+  { NULL, NULL, NULL, NULL }
+};
+
+static const FlagDef SERVE_FLAGS[] = {
+  { "-h", "--help",        NULL,        "show this help"                                        },
+  { "-s", "--scripts-dir", "<base-dir>","serve bundles of shared/ plus zsh/ and bash/"          },
+  { NULL, "--zsh",         NULL,        "only serve the zsh bundle"                             },
+  { NULL, "--bash",        NULL,        "only serve the bash bundle"                            },
+  { NULL, "--debug",       NULL,        "emit timing variables around the bundle"                },
+  { NULL, "--cutoff",      "<n>",       "change the ordered file cutoff (default: 50)"           },
+  { NULL, NULL, NULL, NULL }
+};
+
+static const FlagDef PROFILE_FLAGS[] = {
+  { "-h", "--help",        NULL,        "show this help"                                        },
+  { "-s", "--scripts-dir", "<base-dir>","profile shared/ then the shell's sub-directory"        },
+  { NULL, "--shell",       "<shell>",   "trace under bash or zsh (default: detected)"           },
+  { NULL, "--cutoff",      "<n>",       "change the ordered file cutoff (default: 50)"           },
+  { NULL, "--top",         "<n>",       "list the n costliest lines (default: 10)"              },
+  { NULL, "--folded",      NULL,        "print folded stacks in microseconds for a flamegraph"  },
+  { NULL, NULL, NULL, NULL }
+};
+
 static const FlagDef EDIT_FLAGS[] = {
   { "-h", "--help",   NULL,  "show this help"                             },
   { NULL, "--shared", NULL,  "operate in the shared/ directory (default)" },
@@ -142,6 +463,10 @@ static const FlagDef EDIT_FLAGS[] = {
 static int list_main(int argc, char **argv);
 static int bundle_main(int argc, char **argv);
 static int init_main(int argc, char **argv);
+static int hook_main(int argc, char **argv);
+static int watch_main(int argc, char **argv);
+static int serve_main(int argc, char **argv);
+static int profile_main(int argc, char **argv);
 static int edit_main(int argc, char **argv);
 
 /* -------------------------------------------------------------------------
@@ -172,6 +497,36 @@ static const Subcommand SUBCOMMANDS[] = {
     INIT_FLAGS,
     init_main
   },
+  {
+    "hook",
+    "print a shell startup snippet that sources the cached bundle",
+    "hook <directory> [options]\n"
+    "       hook --scripts-dir <base-dir> [options]",
+    HOOK_FLAGS,
+    hook_main
+  },
+  {
+    "watch",
+    "keep cached bundles regenerated as scripts change",
+    "watch --scripts-dir <base-dir> [options]",
+    WATCH_FLAGS,
+    watch_main
+  },
+  {
+    "serve",
+    "answer bundle requests from memory over a Unix socket",
+    "serve --scripts-dir <base-dir> [options]",
+    SERVE_FLAGS,
+    serve_main
+  },
+  {
+    "profile",
+    "trace a bundle being sourced and report time per file and line",
+    "profile <directory> [options]\n"
+    "       profile --scripts-dir <base-dir> [options]",
+    PROFILE_FLAGS,
+    profile_main
+  },
   {
     "edit",
     "write, append, or remove script files",
@@ -193,23 +548,136 @@ static const Subcommand *find_subcommand(const char *name);
 static void  print_top_level_usage(const char *progname);
 static void  print_subcommand_help(const char *progname, const Subcommand *cmd);
 static int   load_sorted_dir(const char *path, unsigned int cutoff, SortedDir *out);
-static int   bundle_append_dir(const char *dir_path, SortedDir *sd,
-               char **buffer, size_t *capacity, size_t *size, int *line_offset);
+static int   scan_dir_entries(const char *path, SortedDir *out);
+static int   scan_accept(SortedDir *out, const char *name, unsigned char d_type);
+static void  free_sorted_dir(SortedDir *sd);
+static int   sorted_dir_add(SortedDir *sd, const char *name, int order_num);
+static const char *entry_name(const SortedDir *sd, const FileEntry *fe);
+static void  init_bundle_source(BundleSource *src, const char *path);
+static void *scan_source_thread(void *arg);
+static int   scan_bundle_sources(BundleSource *sources, int count,
+               unsigned int cutoff, int jobs);
+static void  free_bundle_sources(BundleSource *sources, int count);
+static void  load_slot(FileSlot *slot, Boolean zero_copy);
+static int   take_large_body(FileSlot *slot, int fd, Boolean zero_copy);
+static Boolean script_size_kept(FileSlot *slot, int fd);
+static void  load_borrowed_body(FileSlot *slot);
+static void  release_slot(FileSlot *slot);
+static void *pipeline_loader(void *arg);
+static void *readahead_hints(void *arg);
+static int   bundle_append_file(Emitter *em, FileSlot *slot, int *line_offset,
+               Boolean timed, uint64_t *body_offset);
+static int   bundle_append_dirs(BundleSource *sources, int source_count, Emitter *em,
+               int *line_offset, Boolean timed, const LoadOptions *opts,
+               LoadStats *stats, BundleCache *cache);
+static const char *detect_shell_subdir(const char *shell_override);
+static void  print_shell_quoted(const char *s);
+static int   plan_bundle_sources(const BundleSpec *spec, BundleSource *sources);
+static int   bundle_generate(Emitter *em, const BundleSpec *spec, BundleSource *sources,
+               int *source_count, const LoadOptions *load, LoadStats *stats,
+               BundleCache *cache);
+static void  print_bundle_stats(const LoadStats *stats, const LoadOptions *load,
+               const struct timespec *started);
+static int   uring_init(Uring *r, unsigned int entries);
+static void  uring_free(Uring *r);
+static int   uring_load_slots(Uring *r, FileSlot *slots, size_t n, Boolean zero_copy);
 
 static const char *find_last_path_separator(const char *path);
 static int         extract_order_number(const char *filename);
 static const char *extract_suffix(const char *filename);
-static int         compare_ordered_files(const void *a, const void *b);
-static int    compare_unordered(const void *a, const void *b);
-static char  *read_file_contents(const char *directory, const char *filename, size_t *size);
-static char  *ensure_buffer_capacity(char *buffer, size_t *capacity, size_t needed);
+static uint64_t    pack_sort_prefix(const char *s);
+static int         compare_entry_keys(const FileEntry *a, const FileEntry *b, const char *names);
+static int         compare_name_keys(const void *a, const void *b);
+static void  sort_by_name_key(FileEntry *v, size_t n, const char *names);
+static void  sort_by_order_number(FileEntry *v, size_t n, FileEntry *tmp, const char *names);
+static int    open_script(int dir_fd, const char *directory, const char *filename, struct stat *st);
+static char  *read_open_file(int fd, const char *directory, const char *filename,
+                size_t expected, size_t *size, unsigned int *calls);
 static size_t count_lines(const char *content, size_t size);
 
+/* Bundle output helpers */
+static void  emit_init(Emitter *em, int fd);
+static int   emit_text(Emitter *em, const char *fmt, ...);
+static int   emit_owned(Emitter *em, void *data, size_t len);
+static int   emit_mapped(Emitter *em, void *map, size_t len);
+static int   emit_flush(Emitter *em);
+static int   emit_file(Emitter *em, int fd, off_t offset, size_t len);
+static int   count_mapped_lines(int fd, size_t size, size_t *lines);
+static int   count_guarded_lines(const char *map, size_t size, size_t *lines);
+static void *map_script(int fd, size_t size);
+
+/* Atomic output helpers */
+static int     output_begin(OutputFile *out, const char *path);
+static Boolean same_contents(int a, int b);
+static int     output_commit(OutputFile *out);
+static void    output_abort(OutputFile *out);
+
+/* Bundle cache helpers */
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len);
+static int64_t  stat_mtime_ns(const struct stat *st);
+static int   make_dirs(const char *path);
+static int   cache_base_dir(char *dir, size_t size);
+static int   bundle_key(const BundleSpec *spec, char *real, uint64_t *key);
+static int   absolute_path(const char *path, char *out, size_t size);
+static int   cache_open(BundleCache *c, const BundleSpec *spec);
+static int   cache_stamp_base(BundleCache *c, const BundleSpec *spec);
+static int   compare_segments(const void *a, const void *b);
+static int   manifest_parse(char *text, Manifest *m);
+static void  manifest_free(Manifest *m);
+static int   manifest_matches(const Manifest *m, LoadStats *stats);
+static int   cache_serve(BundleCache *c, Emitter *out, LoadStats *stats);
+static int   cache_serve_stale(BundleCache *c, Emitter *out, unsigned int max_stale,
+               LoadStats *stats);
+static int   detach_revalidation(void);
+static int   cache_begin(BundleCache *c);
+static int   cache_record_sources(BundleCache *c, const BundleSource *sources, int count);
+static int   cache_publish(BundleCache *c, int fd);
+static void  cache_close(BundleCache *c);
+static int   cache_lock(BundleCache *c, Boolean wait);
+static void  cache_unlock(BundleCache *c);
+
 /* Edit-subcommand helpers */
 static int   FlagMatches(FlagDef flag, const char *argument);
 static int   file_exists(const char *path);
 static char *build_path(const char *sub_dir, const char *filename);
 static char *read_stdin_to_buffer(void);
+static void  touch_parent_dir(const char *path);
+
+/* Watch helpers */
+#ifdef __linux__
+static int   watch_rebuild(const char *scripts_dir, const char *shell, const char *output,
+               unsigned int cutoff, Boolean debug, int null_fd);
+static int   watch_add_dirs(int fd, const char *scripts_dir, int wds[4]);
+static Boolean watch_is_subdir(const char *name);
+static int   watch_read_events(int fd, const char *scripts_dir, int wds[4],
+               const char **shells, int shell_count, unsigned *pending);
+#endif
+
+/* Serve daemon and client helpers */
+static int   daemon_socket_path(const BundleSpec *spec, char *path, size_t size);
+static int   daemon_connect(const char *path);
+static int   daemon_fetch(const BundleSpec *spec, Emitter *out, LoadStats *stats);
+#ifdef __linux__
+static void  serve_on_signal(int sig);
+static int   serve_build(ServeVariant *v);
+static void  serve_answer(const ServeVariant *v);
+static int   serve_listen(ServeVariant *v);
+#endif
+
+/* Startup profiler helpers */
+static int   profile_read_bundle(const char *text, size_t size, ProfileReport *r);
+static int   profile_file_index(ProfileReport *r, const char *path, size_t len);
+static int   profile_first_word(const char *p, const char *end, char *word, size_t size);
+static char *profile_frames(const char *p, const char *end);
+static int64_t profile_stamp_us(const char *p, const char *end);
+static int   profile_read_trace(const char *text, size_t size, const char *bundle_path,
+               ProfileReport *r);
+static void  profile_classify(ProfileReport *r, int to_shell, FILE *from_shell);
+static void  profile_print(ProfileReport *r, const char *text, const char *shell, unsigned top);
+static int   profile_print_folded(const ProfileReport *r);
+static void  profile_free(ProfileReport *r);
+static int   profile_run(const char *shell, const char *bundle_path, const char *trace_path,
+               ProfileReport *r);
 
 /* =========================================================================
  * main — global flag handling and subcommand dispatch
@@ -312,328 +780,1165 @@ static void print_subcommand_help(const char *progname, const Subcommand *cmd) {
  * ====================================================================== */
 
 /**
- * Opens path, reads all non-skipped entries, categorises them into
+ * Opens path, reads all non-skipped regular files, categorises them into
  * lower/unordered/upper buckets, and sorts each bucket.
  * Returns 0 on success, -1 on failure (error printed to stderr).
+ * On success the caller owns out and must release it with free_sorted_dir();
+ * out->dir_fd stays open until then so files can be opened relative to it.
  */
 static int load_sorted_dir(const char *path, unsigned int cutoff, SortedDir *out) {
   memset(out, 0, sizeof(*out));
 
-  DIR *dir = opendir(path);
-  if (!dir) {
+  out->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (out->dir_fd < 0) {
     fprintf(stderr, "Error opening directory '%s': %s\n", path, strerror(errno));
     return -1;
   }
 
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-      continue;
-    if (strncmp(entry->d_name, "skip.", 5) == 0)
-      continue;
+  if (scan_dir_entries(path, out) != 0) {
+    free_sorted_dir(out);
+    return -1;
+  }
 
-    int order_num = extract_order_number(entry->d_name);
-    FileEntry fe  = {0};
-    strncpy(fe.name, entry->d_name, MAX_FILENAME - 1);
-    fe.order_num = order_num;
-    fe.bytesize  = (unsigned int)strlen(fe.name);
-    out->total_bytesize += (int)fe.bytesize + 2;
-
-    if (order_num >= 0 && (unsigned int)order_num < cutoff) {
-      if (out->lower_count < MAX_FILES)
-        out->lower_files[out->lower_count++] = fe;
-    } else if (order_num >= 0) {
-      if (out->upper_count < MAX_FILES)
-        out->upper_files[out->upper_count++] = fe;
-    } else {
-      if (out->unordered_count < MAX_FILES)
-        out->unordered_files[out->unordered_count++] = fe;
-    }
+  if (out->count == 0) return 0;
+
+  /* Stable partition into lower | unordered | upper, then sort each range */
+  FileEntry *sorted = malloc(out->count * sizeof(FileEntry));
+  if (!sorted) {
+    fprintf(stderr, "Cannot allocate file index for '%s'\n", path);
+    free_sorted_dir(out);
+    return -1;
   }
-  closedir(dir);
 
-  qsort(out->lower_files,     out->lower_count,     sizeof(FileEntry), compare_ordered_files);
-  qsort(out->upper_files,     out->upper_count,     sizeof(FileEntry), compare_ordered_files);
-  qsort(out->unordered_files, out->unordered_count, sizeof(FileEntry), compare_unordered);
+  for (size_t i = 0; i < out->count; i++) {
+    int n = out->entries[i].order_num;
+    if      (n >= 0 && (unsigned int)n < cutoff) out->lower_count++;
+    else if (n < 0)                              out->unordered_count++;
+  }
+  out->upper_count = out->count - out->lower_count - out->unordered_count;
+
+  size_t next[3] = { 0, out->lower_count, out->lower_count + out->unordered_count };
+  for (size_t i = 0; i < out->count; i++) {
+    int n = out->entries[i].order_num;
+    int g = (n >= 0 && (unsigned int)n < cutoff) ? 0 : (n < 0 ? 1 : 2);
+    sorted[next[g]++] = out->entries[i];
+  }
+
+  /* The scan-order array doubles as radix scratch space before release */
+  FileEntry *scratch = out->entries;
+  out->entries  = sorted;
+  out->capacity = out->count;
+
+  FileEntry *lower     = out->entries;
+  FileEntry *unordered = lower + out->lower_count;
+  FileEntry *upper     = unordered + out->unordered_count;
+
+  sort_by_order_number(lower, out->lower_count, scratch, out->names);
+  sort_by_name_key(unordered, out->unordered_count, out->names);
+  sort_by_order_number(upper, out->upper_count, scratch, out->names);
+  free(scratch);
 
   return 0;
 }
 
+#ifdef __linux__
+/* Record layout returned by the getdents64 syscall */
+struct linux_dirent64 {
+  uint64_t       d_ino;
+  int64_t        d_off;
+  unsigned short d_reclen;
+  unsigned char  d_type;
+  char           d_name[];
+};
+#endif
+
 /**
- * Appends every file in sd (lower → unordered → upper) to an existing
- * bundle buffer, injecting section headers and updating line_offset so
- * that the _SCRIPTSORT_OFFSET values reflect real bundle line numbers.
+ * Feeds every entry of out->dir_fd to scan_accept(). On Linux entries are
+ * pulled straight from the kernel in DIRENT_BUFFER_SIZE batches via
+ * getdents64; elsewhere readdir() on a duplicate of the fd is used.
+ * Returns 0 on success, -1 on failure (error printed to stderr).
  */
-static int bundle_append_dir(
-  const char *dir_path, SortedDir *sd,
-  char **buffer, size_t *capacity, size_t *size,
-  int *line_offset
-) {
-  char   header[MAX_FILENAME * 2 + 128];
-  size_t header_len;
-  size_t file_size;
-  char  *file_contents;
+static int scan_dir_entries(const char *path, SortedDir *out) {
+#ifdef __linux__
+  char *batch = malloc(DIRENT_BUFFER_SIZE);
+  if (!batch) {
+    fprintf(stderr, "Cannot allocate directory buffer for '%s'\n", path);
+    return -1;
+  }
 
-  /* Include the sub-directory basename so _SCRIPTSORT_FILE reads as e.g.
-   * "shared/aliases" or "zsh/env.pyenv" rather than a bare filename. */
-  const char *sep     = find_last_path_separator(dir_path);
-  const char *dir_label = sep ? sep + 1 : dir_path;
+  for (;;) {
+    long n = syscall(SYS_getdents64, out->dir_fd, batch, DIRENT_BUFFER_SIZE);
+    if (n == 0) break;
+    if (n < 0) {
+      fprintf(stderr, "Error reading directory '%s': %s\n", path, strerror(errno));
+      free(batch);
+      return -1;
+    }
+    for (long off = 0; off < n; ) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(batch + off);
+      if (scan_accept(out, d->d_name, d->d_type) != 0) { free(batch); return -1; }
+      off += d->d_reclen;
+    }
+  }
+  free(batch);
+  return 0;
+#else
+  int fd  = dup(out->dir_fd);
+  DIR *dir = (fd >= 0) ? fdopendir(fd) : NULL;
+  if (!dir) {
+    fprintf(stderr, "Error reading directory '%s': %s\n", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (scan_accept(out, entry->d_name, entry->d_type) != 0) { closedir(dir); return -1; }
+  }
+  closedir(dir);
+  return 0;
+#endif
+}
 
-  FileEntry *groups[3] = { sd->lower_files, sd->unordered_files, sd->upper_files };
-  int        counts[3] = { sd->lower_count, sd->unordered_count, sd->upper_count };
+/**
+ * Adds name to the index if it is a non-skipped regular file. d_type settles
+ * most entries for free; only symlinks and filesystems that report
+ * DT_UNKNOWN cost an fstatat(), which follows links so broken ones drop out.
+ * Returns 0 (whether or not the entry was kept), -1 on allocation failure.
+ */
+static int scan_accept(SortedDir *out, const char *name, unsigned char d_type) {
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    return 0;
+  if (strncmp(name, "skip.", 5) == 0)
+    return 0;
 
-  for (int g = 0; g < 3; g++) {
-    for (int i = 0; i < counts[g]; i++) {
-      file_contents = read_file_contents(dir_path, groups[g][i].name, &file_size);
-      if (!file_contents) continue;
+  if (d_type != DT_REG) {
+    struct stat st;
+    if (d_type != DT_LNK && d_type != DT_UNKNOWN)
+      return 0;
+    if (fstatat(out->dir_fd, name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+      return 0;
+  }
 
-      /* Header is 4 lines: blank + comment + _FILE + _OFFSET */
-      size_t file_lines = count_lines(file_contents, file_size);
-      int    file_start = *line_offset + 5;
-      int    file_end   = file_start + (file_lines > 0 ? (int)file_lines - 1 : 0);
+  return sorted_dir_add(out, name, extract_order_number(name));
+}
 
-      header_len = (size_t)snprintf(header, sizeof(header),
-        "\n# --- %s/%s (lines %d-%d) ---\n_SCRIPTSORT_FILE='%s/%s'\n_SCRIPTSORT_OFFSET=%d\n",
-        dir_label, groups[g][i].name, file_start, file_end,
-        dir_label, groups[g][i].name, file_start);
-      *line_offset = file_end + 1;
+static void free_sorted_dir(SortedDir *sd) {
+  if (sd->dir_fd >= 0) close(sd->dir_fd);
+  free(sd->names);
+  free(sd->entries);
+  memset(sd, 0, sizeof(*sd));
+  sd->dir_fd = -1;
+}
 
-      *buffer = ensure_buffer_capacity(*buffer, capacity, *size + header_len + file_size + 2);
-      if (!*buffer) { free(file_contents); return -1; }
+/**
+ * Copies name into the arena and appends an index entry for it, growing
+ * either allocation by doubling when full.
+ * Returns 0 on success, -1 on allocation failure (error printed to stderr).
+ */
+static int sorted_dir_add(SortedDir *sd, const char *name, int order_num) {
+  size_t len = strlen(name);
+
+  if (sd->names_size + len + 1 > sd->names_capacity) {
+    size_t cap = sd->names_capacity ? sd->names_capacity : INITIAL_NAMES_SIZE;
+    while (cap < sd->names_size + len + 1) cap *= 2;
+    char *nn = realloc(sd->names, cap);
+    if (!nn) {
+      fprintf(stderr, "Failed to grow name arena to %zu bytes\n", cap);
+      return -1;
+    }
+    sd->names          = nn;
+    sd->names_capacity = cap;
+  }
 
-      strcat(*buffer + *size, header);
-      *size += header_len;
-      strcat(*buffer + *size, file_contents);
-      *size += file_size;
-      (*buffer)[(*size)++] = '\n';
-      (*buffer)[*size]      = '\0';
-      free(file_contents);
+  if (sd->count == sd->capacity) {
+    size_t cap = sd->capacity ? sd->capacity * 2 : INITIAL_INDEX_SIZE;
+    FileEntry *ne = realloc(sd->entries, cap * sizeof(FileEntry));
+    if (!ne) {
+      fprintf(stderr, "Failed to grow file index to %zu entries\n", cap);
+      return -1;
     }
+    sd->entries  = ne;
+    sd->capacity = cap;
   }
+
+  FileEntry *fe = &sd->entries[sd->count++];
+  fe->name_off  = sd->names_size;
+  fe->name_len  = (unsigned int)len;
+  fe->order_num = order_num;
+
+  /* Sort keys are fixed at scan time so sorting never re-parses names */
+  fe->suffix_off  = (order_num >= 0) ? (unsigned int)(extract_suffix(name) - name) : 0;
+  fe->sort_prefix = pack_sort_prefix(name + fe->suffix_off);
+
+  memcpy(sd->names + sd->names_size, name, len + 1);
+  sd->names_size     += len + 1;
+  sd->total_bytesize += len + 2;
   return 0;
 }
 
-/* =========================================================================
- * list subcommand
- * ====================================================================== */
+static const char *entry_name(const SortedDir *sd, const FileEntry *fe) {
+  return sd->names + fe->name_off;
+}
 
-static int list_main(int argc, char **argv) {
-  const char  *directory    = NULL;
-  unsigned int cutoff_count = 50;
+static void init_bundle_source(BundleSource *src, const char *path) {
+  memset(src, 0, sizeof(*src));
+  src->sd.dir_fd = -1;
+  snprintf(src->path, sizeof(src->path), "%s", path);
 
-  for (int i = 1; i < argc; i++) {
-    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-      print_subcommand_help("scriptsort", find_subcommand("list"));
-      return EXIT_SUCCESS;
-    } else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc) {
-      int n = atoi(argv[++i]);
-      if (n <= 0) {
-        fprintf(stderr, SGR_RED "--cutoff requires a number greater than 0\n" SGR_RESET);
-        return EXIT_FAILURE;
-      }
-      cutoff_count = (unsigned int)n;
-    } else if (argv[i][0] != '-' && !directory) {
-      directory = argv[i];
-    } else {
-      fprintf(stderr, SGR_RED "Unknown argument: %s\n" SGR_RESET, argv[i]);
-      return EXIT_FAILURE;
-    }
+  /* Include the sub-directory basename so _SCRIPTSORT_FILE reads as e.g.
+   * "shared/aliases" or "zsh/env.pyenv" rather than a bare filename. */
+  const char *sep = find_last_path_separator(src->path);
+  src->label = sep ? sep + 1 : src->path;
+}
+
+static void *scan_source_thread(void *arg) {
+  ScanJob *job = (ScanJob *)arg;
+  job->rc = load_sorted_dir(job->source->path, job->cutoff, &job->source->sd);
+  return NULL;
+}
+
+/**
+ * Scans every source, concurrently when jobs > 1, and drops any that fail
+ * (errors printed to stderr) while keeping the rest in order.
+ * Returns the number of sources left.
+ */
+static int scan_bundle_sources(BundleSource *sources, int count, unsigned int cutoff, int jobs) {
+  ScanJob   scan[2];
+  pthread_t threads[2];
+  Boolean   started[2] = { Falsehood, Falsehood };
+  int       kept       = 0;
+
+  if (count > 2) count = 2;
+  for (int i = 0; i < count; i++) {
+    scan[i].source = &sources[i];
+    scan[i].cutoff = cutoff;
+    scan[i].rc     = -1;
   }
 
-  if (!directory) {
-    print_subcommand_help("scriptsort", find_subcommand("list"));
-    return EXIT_FAILURE;
+  /* The first source is scanned on this thread while the others run */
+  for (int i = 1; i < count && jobs > 1; i++)
+    started[i] = (pthread_create(&threads[i], NULL, scan_source_thread, &scan[i]) == 0);
+  for (int i = 0; i < count; i++) {
+    if (started[i]) pthread_join(threads[i], NULL);
+    else            scan_source_thread(&scan[i]);
   }
 
-  SortedDir sd;
-  if (load_sorted_dir(directory, cutoff_count, &sd) != 0)
-    return EXIT_FAILURE;
+  for (int i = 0; i < count; i++) {
+    if (scan[i].rc != 0) continue;
+    if (kept != i) {
+      sources[kept] = sources[i];
+      sources[kept].label = sources[kept].path + (sources[i].label - sources[i].path);
+    }
+    kept++;
+  }
+  return kept;
+}
 
-  String buffer = calloc(1, (size_t)sd.total_bytesize + 1);
-  if (!buffer) {
-    fprintf(stderr, "Cannot allocate buffer\n");
-    return EXIT_FAILURE;
+static void free_bundle_sources(BundleSource *sources, int count) {
+  for (int i = 0; i < count; i++) free_sorted_dir(&sources[i].sd);
+}
+
+/**
+ * Loads one slot: keeps the file open and line-counted for zero-copy
+ * emission, or maps it, when that pays off; otherwise reads it into
+ * memory. On failure the error is already printed and the slot is marked
+ * failed so the emitter skips it.
+ */
+static void load_slot(FileSlot *slot, Boolean zero_copy) {
+  const SortedDir *sd = &slot->source->sd;
+  struct stat      st;
+
+  if (slot->borrowed) {
+    load_borrowed_body(slot);
+    return;
+  }
+  int fd = open_script(sd->dir_fd, slot->source->path, slot->name, &st);
+  slot->syscalls += 2;
+  if (fd < 0) {
+    slot->failed = Truth;
+    return;
   }
+  slot->size = (size_t)st.st_size;
 
-  size_t cur = 0;
-  for (int i = 0; i < sd.lower_count;     i++) cur += (size_t)sprintf(buffer + cur, "%s\n", sd.lower_files[i].name);
-  for (int i = 0; i < sd.unordered_count; i++) cur += (size_t)sprintf(buffer + cur, "%s\n", sd.unordered_files[i].name);
-  for (int i = 0; i < sd.upper_count;     i++) cur += (size_t)sprintf(buffer + cur, "%s\n", sd.upper_files[i].name);
+  switch (take_large_body(slot, fd, zero_copy)) {
+    case 1:  return;
+    case 0:  close(fd); slot->syscalls++; return;
+    default: break;
+  }
 
-  printf("%s", buffer);
-  free(buffer);
-  return EXIT_SUCCESS;
+  slot->contents = read_open_file(fd, slot->source->path, slot->name, slot->size,
+                                  &slot->size, &slot->syscalls);
+  close(fd);
+  slot->syscalls++;
+  if (slot->contents) slot->lines = count_lines(slot->contents, slot->size);
+  else                slot->failed = Truth;
 }
 
 /* =========================================================================
- * bundle subcommand
+ * io_uring engine (bundle --io uring)
+ *
+ * Talks to the kernel through the raw io_uring_setup/io_uring_enter
+ * syscalls with locally declared ABI structs, so building needs neither
+ * liburing nor new kernel headers. Kernels without io_uring (or sandboxes
+ * that block it) make uring_init() fail and loaders fall back to the
+ * synchronous path.
  * ====================================================================== */
 
-static int bundle_main(int argc, char **argv) {
-  const char  *directory        = NULL;
-  const char  *scripts_dir      = NULL;
-  const char  *shell_override   = NULL;
-  Boolean      debugtext        = Falsehood;
-  unsigned int cutoff_count     = 50;
+#ifdef __linux__
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup  425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter  426
+#endif
+
+#define URING_OP_OPENAT          18
+#define URING_OP_CLOSE           19
+#define URING_OP_STATX           21
+#define URING_OP_READ            22
+#define URING_FEAT_SINGLE_MMAP   1u
+#define URING_ENTER_GETEVENTS    1u
+#define URING_OFF_SQ_RING        0ULL
+#define URING_OFF_CQ_RING        0x8000000ULL
+#define URING_OFF_SQES           0x10000000ULL
+#define URING_STATX_TYPE_SIZE    0x201u  /* STATX_TYPE | STATX_SIZE */
+
+/* Kernel ABI: struct io_uring_sqe (64 bytes) */
+struct uring_sqe {
+  uint8_t  opcode;
+  uint8_t  flags;
+  uint16_t ioprio;
+  int32_t  fd;
+  uint64_t off;        /* file offset; statx result buffer for STATX */
+  uint64_t addr;       /* buffer or pathname */
+  uint32_t len;        /* byte count; statx mask for STATX */
+  uint32_t op_flags;   /* open flags, statx flags, ... */
+  uint64_t user_data;
+  uint16_t buf_index;
+  uint16_t personality;
+  int32_t  file_index;
+  uint64_t pad[2];
+};
 
-  for (int i = 1; i < argc; i++) {
-    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-      print_subcommand_help("scriptsort", find_subcommand("bundle"));
-      return EXIT_SUCCESS;
-    } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--scripts-dir") == 0) && i + 1 < argc) {
-      scripts_dir = argv[++i];
-    } else if (strcmp(argv[i], "--zsh") == 0) {
-      shell_override = SUB_ZSH;
-    } else if (strcmp(argv[i], "--bash") == 0) {
-      shell_override = SUB_BASH;
-    } else if (strcmp(argv[i], "--debug") == 0) {
-      debugtext = Truth;
-    } else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc) {
-      int n = atoi(argv[++i]);
-      if (n <= 0) {
-        fprintf(stderr, SGR_RED "--cutoff requires a number greater than 0\n" SGR_RESET);
-        return EXIT_FAILURE;
-      }
-      cutoff_count = (unsigned int)n;
-    } else if (argv[i][0] != '-' && !directory && !scripts_dir) {
-      directory = argv[i];
-    } else {
-      fprintf(stderr, SGR_RED "Unknown argument: %s\n" SGR_RESET, argv[i]);
-      return EXIT_FAILURE;
-    }
-  }
+/* Kernel ABI: struct io_uring_cqe */
+struct uring_cqe {
+  uint64_t user_data;
+  int32_t  res;
+  uint32_t flags;
+};
 
-  if (scripts_dir && directory) {
-    fprintf(stderr, SGR_RED "--scripts-dir and <directory> are mutually exclusive\n" SGR_RESET);
-    return EXIT_FAILURE;
-  }
-  if (shell_override && !scripts_dir) {
-    fprintf(stderr, SGR_RED "--zsh/--bash require --scripts-dir (-s)\n" SGR_RESET);
-    return EXIT_FAILURE;
-  }
-  if (!scripts_dir && !directory) {
-    print_subcommand_help("scriptsort", find_subcommand("bundle"));
-    return EXIT_FAILURE;
-  }
+/* Kernel ABI: struct io_uring_params and its ring offset tables */
+struct uring_sq_offsets {
+  uint32_t head, tail, ring_mask, ring_entries, flags, dropped, array, resv1;
+  uint64_t resv2;
+};
+struct uring_cq_offsets {
+  uint32_t head, tail, ring_mask, ring_entries, overflow, cqes, flags, resv1;
+  uint64_t resv2;
+};
+struct uring_params {
+  uint32_t sq_entries, cq_entries, flags, sq_thread_cpu, sq_thread_idle;
+  uint32_t features, wq_fd, resv[3];
+  struct uring_sq_offsets sq_off;
+  struct uring_cq_offsets cq_off;
+};
 
-  size_t buffer_capacity = INITIAL_BUFFER_SIZE;
-  size_t current_size    = 0;
-  /* Preamble emits 4 code lines + 1 blank = 5 lines; debug start_time adds 1 more */
-  int    line_offset     = (debugtext ? 1 : 0) + 5;
+/* Kernel ABI: the leading fields of struct statx, padded to full size */
+struct uring_statx {
+  uint32_t mask;
+  uint32_t blksize;
+  uint64_t attributes;
+  uint32_t nlink, uid, gid;
+  uint16_t mode;
+  uint16_t spare0;
+  uint64_t ino;
+  uint64_t size;
+  uint8_t  rest[256 - 48];
+};
 
-  char *buffer = malloc(buffer_capacity);
-  if (!buffer) {
-    fprintf(stderr, "Failed to allocate initial buffer\n");
-    return EXIT_FAILURE;
-  }
-  buffer[0] = '\0';
+struct Uring {
+  int               ring_fd;
+  unsigned int      sq_mask;
+  unsigned int      sq_entries;
+  unsigned int      cq_mask;
+  unsigned int     *sq_head;
+  unsigned int     *sq_tail;
+  unsigned int     *sq_array;
+  unsigned int     *cq_head;
+  unsigned int     *cq_tail;
+  struct uring_sqe *sqes;
+  struct uring_cqe *cqes;
+  void             *sq_ring;
+  void             *cq_ring;
+  size_t            sq_ring_size;
+  size_t            cq_ring_size;
+  size_t            sqes_size;
+  unsigned int      pending;   /* SQEs queued since the last submit */
+  unsigned long     syscalls;  /* io_uring_enter calls plus fallbacks */
+  int               error;     /* errno of the failure that broke it, or 0 */
+};
 
-  if (scripts_dir) {
-    /*
-     * Resolve which shell-specific sub-directory to include after shared/.
-     *
-     * An explicit --zsh or --bash flag takes priority over auto-detection.
-     * Auto-detection checks ZSH_VERSION / BASH_VERSION first (definitive when
-     * exported), then falls back to $SHELL basename (always exported, correct
-     * for the common case where login shell == current shell).
-     */
-    const char *shell_subdir = shell_override;
-    if (!shell_subdir && getenv("ZSH_VERSION")) {
-      shell_subdir = SUB_ZSH;
-    } else if (!shell_subdir && getenv("BASH_VERSION")) {
-      shell_subdir = SUB_BASH;
-    } else if (!shell_subdir) {
-      const char *shell = getenv("SHELL");
-      if (shell) {
-        const char *name = find_last_path_separator(shell);
-        name = name ? name + 1 : shell;
-        if      (strcmp(name, "zsh")  == 0) shell_subdir = SUB_ZSH;
-        else if (strcmp(name, "bash") == 0) shell_subdir = SUB_BASH;
-      }
-    }
-
-    char      path[PATH_MAX];
-    struct stat st;
+static int uring_init(Uring *r, unsigned int entries) {
+  struct uring_params p;
 
-    /* shared/ — always first */
-    snprintf(path, sizeof(path), "%s/" SUB_SHARED, scripts_dir);
-    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
-      SortedDir sd;
-      if (load_sorted_dir(path, cutoff_count, &sd) == 0) {
-        if (bundle_append_dir(path, &sd, &buffer, &buffer_capacity, &current_size, &line_offset) != 0) {
-          free(buffer); return EXIT_FAILURE;
-        }
-      }
-    }
+  memset(r, 0, sizeof(*r));
+  memset(&p, 0, sizeof(p));
+  r->ring_fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (r->ring_fd < 0) return -1;
 
-    /* Shell-specific sub-directory — only when shell is detected */
-    if (shell_subdir) {
-      snprintf(path, sizeof(path), "%s/%s", scripts_dir, shell_subdir);
-      if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
-        SortedDir sd;
-        if (load_sorted_dir(path, cutoff_count, &sd) == 0) {
-          if (bundle_append_dir(path, &sd, &buffer, &buffer_capacity, &current_size, &line_offset) != 0) {
-            free(buffer); return EXIT_FAILURE;
-          }
-        }
-      }
-    }
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  r->cq_ring_size = p.cq_off.cqes  + p.cq_entries * sizeof(struct uring_cqe);
+  if ((p.features & URING_FEAT_SINGLE_MMAP) && r->cq_ring_size > r->sq_ring_size)
+    r->sq_ring_size = r->cq_ring_size;
 
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->ring_fd, URING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) { close(r->ring_fd); return -1; }
+
+  if (p.features & URING_FEAT_SINGLE_MMAP) {
+    r->cq_ring      = r->sq_ring;
+    r->cq_ring_size = 0;
   } else {
-    SortedDir sd;
-    if (load_sorted_dir(directory, cutoff_count, &sd) != 0) {
-      free(buffer); return EXIT_FAILURE;
-    }
-    if (bundle_append_dir(directory, &sd, &buffer, &buffer_capacity, &current_size, &line_offset) != 0) {
-      free(buffer); return EXIT_FAILURE;
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->ring_fd, URING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      munmap(r->sq_ring, r->sq_ring_size);
+      close(r->ring_fd);
+      return -1;
     }
   }
 
-  if (debugtext) {
-    printf("local start_time=%s\n",
-      "$(command 2>&1 >/dev/null -v ms && ms || printf '0')");
+  r->sqes_size = p.sq_entries * sizeof(struct uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->ring_fd, URING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    if (r->cq_ring_size) munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->ring_fd);
+    return -1;
   }
 
-  printf(
-    "_SCRIPTSORT_OLD_TRAP=$(trap -p ERR)\n"
-    "_SCRIPTSORT_FILE=''\n"
-    "_SCRIPTSORT_OFFSET=0\n"
-    "trap 'printf \"scriptsort: error sourcing \\\"${_SCRIPTSORT_FILE}\\\" "
-      "(bundle line ${_SCRIPTSORT_OFFSET})\\n\" >&2' ERR\n"
-    "\n"
-  );
+  char *sq = (char *)r->sq_ring;
+  char *cq = (char *)r->cq_ring;
+  r->sq_head    = (unsigned int *)(sq + p.sq_off.head);
+  r->sq_tail    = (unsigned int *)(sq + p.sq_off.tail);
+  r->sq_array   = (unsigned int *)(sq + p.sq_off.array);
+  r->sq_mask    = *(unsigned int *)(sq + p.sq_off.ring_mask);
+  r->sq_entries = *(unsigned int *)(sq + p.sq_off.ring_entries);
+  r->cq_head    = (unsigned int *)(cq + p.cq_off.head);
+  r->cq_tail    = (unsigned int *)(cq + p.cq_off.tail);
+  r->cq_mask    = *(unsigned int *)(cq + p.cq_off.ring_mask);
+  r->cqes       = (struct uring_cqe *)(cq + p.cq_off.cqes);
+  r->syscalls   = 1;
+  return 0;
+}
 
-  printf("%s\n", buffer);
+static void uring_free(Uring *r) {
+  munmap(r->sqes, r->sqes_size);
+  if (r->cq_ring_size) munmap(r->cq_ring, r->cq_ring_size);
+  munmap(r->sq_ring, r->sq_ring_size);
+  close(r->ring_fd);
+}
 
-  printf(
-    "\ntrap - ERR\n"
-    "eval \"$_SCRIPTSORT_OLD_TRAP\"\n"
-    "unset _SCRIPTSORT_OLD_TRAP _SCRIPTSORT_FILE _SCRIPTSORT_OFFSET\n"
-  );
+/* Queues one zeroed SQE; the caller never queues more than sq_entries. */
+static struct uring_sqe *uring_queue(Uring *r, uint8_t opcode, int fd, uint64_t user_data) {
+  unsigned int      tail = *r->sq_tail + r->pending;
+  unsigned int      idx  = tail & r->sq_mask;
+  struct uring_sqe *sqe  = &r->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode    = opcode;
+  sqe->fd        = fd;
+  sqe->user_data = user_data;
+  r->sq_array[idx] = idx;
+  r->pending++;
+  return sqe;
+}
 
-  if (debugtext) {
-    printf("local end_time=%s\n",
-      "$(command 2>&1 >/dev/null -v ms && ms || printf '0')");
-    printf("export SCRIPTSORT_ELAPSED=$(($end_time - $start_time))\n");
-  }
+/* Copies up to want - *got completions from the CQ ring into out. */
+static void uring_reap(Uring *r, unsigned int want, struct uring_cqe *out, unsigned int *got) {
+  unsigned int head = *r->cq_head;
+  unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
 
-  free(buffer);
-  return EXIT_SUCCESS;
+  for (; head != tail && *got < want; head++)
+    out[(*got)++] = r->cqes[head & r->cq_mask];
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
 }
 
-/* =========================================================================
- * init subcommand
- * ====================================================================== */
+/**
+ * Submits everything queued and collects exactly want completions into
+ * out. Returns 0 on success. If io_uring_enter fails, the SQEs it never
+ * took are withdrawn and every one it did take is waited for, so no
+ * buffer is still in the kernel's hands: then -1 is returned with those
+ * completions in out[0..*got). -2 means even that wait failed and the
+ * buffers must be leaked. Either way r->error is set and the ring must
+ * not be used again.
+ */
+static int uring_run(Uring *r, unsigned int want, struct uring_cqe *out, unsigned int *got) {
+  unsigned int queued = r->pending;
 
-static int init_main(int argc, char **argv) {
+  *got = 0;
+  __atomic_store_n(r->sq_tail, *r->sq_tail + r->pending, __ATOMIC_RELEASE);
+
+  while (*got < want) {
+    uring_reap(r, want, out, got);
+    if (*got == want && r->pending == 0) break;
+
+    long n = syscall(__NR_io_uring_enter, r->ring_fd, r->pending,
+                     *got < want ? want - *got : 0, URING_ENTER_GETEVENTS, NULL, 0);
+    r->syscalls++;
+    if (n >= 0) {
+      r->pending -= (unsigned int)n;
+      continue;
+    }
+    if (errno == EINTR) continue;
+    r->error = errno;
+
+    /* Nothing past the kernel's head was read; take those SQEs back */
+    unsigned int submitted = queued - r->pending;
+    __atomic_store_n(r->sq_tail, *r->sq_tail - r->pending, __ATOMIC_RELEASE);
+    r->pending = 0;
+    while (uring_reap(r, submitted, out, got), *got < submitted) {
+      n = syscall(__NR_io_uring_enter, r->ring_fd, 0, submitted - *got,
+                  URING_ENTER_GETEVENTS, NULL, 0);
+      r->syscalls++;
+      if (n < 0 && errno != EINTR) return -2;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Loads n consecutive slots with three batched submissions: openat + statx
+ * for every file, then one read per file, then the closes. Large files
+ * are kept open or mapped as in load_slot() instead of read. Files whose
+ * operations the kernel does not support are loaded synchronously.
+ * Returns 0, or -1 if nothing was loaded: after a ring failure every
+ * request it took has completed and the slots are as they were, so the
+ * caller loads them synchronously. A failed ring has r->error set and
+ * must be freed, even when the slots were loaded.
+ */
+static int uring_load_slots(Uring *r, FileSlot *slots, size_t n, Boolean zero_copy) {
+  struct uring_statx *stx    = calloc(n, sizeof(struct uring_statx));
+  struct uring_cqe   *cqe    = calloc(2 * n, sizeof(struct uring_cqe));
+  int                *opened = calloc(2 * n, sizeof(int));
+  int                *statr  = opened + n;
+  unsigned int        want   = 0;
+  unsigned int        got    = 0;
+  int                 rc     = -1;
+  int                 ran;
+
+  if (!stx || !cqe || !opened) goto done;
+
+  /* 1. Open and size every file in a single submission */
+  for (size_t i = 0; i < n; i++) {
+    const SortedDir  *sd = &slots[i].source->sd;
+    struct uring_sqe *sqe;
+
+    opened[i] = -1;
+    statr[i]  = -1;
+    if (slots[i].borrowed) continue;
+    want += 2;
+    sqe = uring_queue(r, URING_OP_OPENAT, sd->dir_fd, (uint64_t)i << 1);
+    sqe->addr     = (uint64_t)(uintptr_t)slots[i].name;
+    sqe->op_flags = O_RDONLY | O_CLOEXEC;
+
+    sqe = uring_queue(r, URING_OP_STATX, sd->dir_fd, ((uint64_t)i << 1) | 1);
+    sqe->addr = (uint64_t)(uintptr_t)slots[i].name;
+    sqe->len  = URING_STATX_TYPE_SIZE;
+    sqe->off  = (uint64_t)(uintptr_t)&stx[i];
+  }
+  ran = want > 0 ? uring_run(r, want, cqe, &got) : 0;
+  for (size_t c = 0; c < got; c++) {
+    size_t i = (size_t)(cqe[c].user_data >> 1);
+    if (cqe[c].user_data & 1) statr[i]  = cqe[c].res;
+    else                      opened[i] = cqe[c].res;
+  }
+  if (ran != 0) goto fail;
+  want = 0;
+
+  /* 2. One read per file, straight into its final buffer. Nothing else
+   *    happens to a slot until the reads are back, so a failing ring
+   *    leaves the batch as it found it. */
+  for (size_t i = 0; i < n; i++) {
+    FileSlot *slot = &slots[i];
+
+    if (slot->borrowed || opened[i] < 0 || statr[i] < 0 || (stx[i].mode & S_IFMT) != S_IFREG)
+      continue;
+
+    slot->size = (size_t)stx[i].size;
+    int taken  = take_large_body(slot, opened[i], zero_copy);
+    r->syscalls += slot->syscalls;
+    slot->syscalls = 0;
+    if (taken == 1) opened[i] = -1;   /* the slot owns the fd now */
+    if (taken >= 0) continue;
+
+    slot->contents = malloc(slot->size + 1);
+    if (!slot->contents || slot->size == 0) continue;
+
+    struct uring_sqe *sqe = uring_queue(r, URING_OP_READ, opened[i], (uint64_t)i);
+    sqe->addr = (uint64_t)(uintptr_t)slot->contents;
+    sqe->len  = (uint32_t)slot->size;
+    want++;
+  }
+  ran = want > 0 ? uring_run(r, want, cqe, &got) : 0;
+  if (ran == -2) {
+    /* The kernel may still write into the read buffers: leak them */
+    for (size_t i = 0; i < n; i++)
+      if (slots[i].contents && !slots[i].mapped) slots[i].contents = NULL;
+  }
+  if (ran != 0) {
+    for (size_t i = 0; i < n; i++) {
+      if (slots[i].borrowed) continue;
+      release_slot(&slots[i]);
+      slots[i].size  = 0;
+      slots[i].lines = 0;
+    }
+    goto fail;
+  }
+  rc = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    FileSlot   *slot = &slots[i];
+    const char *dir  = slot->source->path;
+
+    if (slot->borrowed) {
+      load_borrowed_body(slot);
+      r->syscalls += slot->syscalls;
+    } else if (opened[i] == -EINVAL || statr[i] == -EINVAL) {
+      /* Opcode unsupported by this kernel */
+      if (opened[i] >= 0) close(opened[i]);
+      opened[i] = -1;
+      load_slot(slot, zero_copy);
+      r->syscalls += slot->syscalls;
+    } else if (opened[i] < 0 && slot->fd < 0) {
+      fprintf(stderr, "Error opening file '%s/%s': %s\n", dir, slot->name, strerror(-opened[i]));
+      slot->failed = Truth;
+    } else if (statr[i] < 0 || (stx[i].mode & S_IFMT) != S_IFREG) {
+      fprintf(stderr, "Error getting file size for '%s/%s': %s\n", dir, slot->name,
+              strerror(statr[i] < 0 ? -statr[i] : EINVAL));
+      slot->failed = Truth;
+    } else if (!slot->contents && slot->fd < 0) {
+      fprintf(stderr, "Error allocating memory for file '%s/%s'\n", dir, slot->name);
+      slot->failed = Truth;
+    }
+  }
+  for (unsigned int c = 0; c < got; c++) {
+    FileSlot *slot = &slots[cqe[c].user_data];
+    size_t    done = cqe[c].res > 0 ? (size_t)cqe[c].res : 0;
+
+    if (cqe[c].res < 0) {
+      fprintf(stderr, "Error reading file '%s/%s': %s\n",
+              slot->source->path, slot->name, strerror(-cqe[c].res));
+      free(slot->contents);
+      slot->contents = NULL;
+      slot->failed   = Truth;
+      continue;
+    }
+    /* Short read: finish synchronously from where the kernel stopped */
+    while (done < slot->size) {
+      ssize_t m = pread(opened[cqe[c].user_data], slot->contents + done, slot->size - done, (off_t)done);
+      r->syscalls++;
+      if (m <= 0 && !(m < 0 && errno == EINTR)) break;
+      if (m > 0) done += (size_t)m;
+    }
+    slot->size = done;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (slots[i].contents && !slots[i].mapped) {
+      slots[i].contents[slots[i].size] = '\0';
+      slots[i].lines = count_lines(slots[i].contents, slots[i].size);
+    }
+  }
+
+  /* 3. Close everything that was opened in one last submission */
+  want = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (opened[i] < 0) continue;
+    uring_queue(r, URING_OP_CLOSE, opened[i], (uint64_t)i);
+    want++;
+  }
+  if (want > 0) uring_run(r, want, cqe, &got);
+  for (unsigned int c = 0; c < got; c++) {
+    if (cqe[c].res != -EINVAL) opened[cqe[c].user_data] = -1;
+  }
+  /* Unsupported by this kernel, or never taken by a failed ring */
+  for (size_t i = 0; i < n; i++) {
+    if (opened[i] < 0) continue;
+    close(opened[i]);
+    r->syscalls++;
+  }
+  goto done;
+
+fail:
+  for (size_t i = 0; i < n; i++)
+    if (opened[i] >= 0) close(opened[i]);
+  fprintf(stderr, "scriptsort: io_uring failed (%s), reading synchronously\n", strerror(r->error));
+
+done:
+  free(stx);
+  free(cqe);
+  free(opened);
+  return rc;
+}
+
+#else /* !__linux__ */
+
+struct Uring { unsigned long syscalls; int error; };
+
+static int  uring_init(Uring *r, unsigned int entries) { (void)r; (void)entries; return -1; }
+static void uring_free(Uring *r) { (void)r; }
+static int  uring_load_slots(Uring *r, FileSlot *slots, size_t n, Boolean zero_copy) {
+  (void)r; (void)slots; (void)n; (void)zero_copy;
+  return -1;
+}
+
+#endif /* __linux__ */
+
+/**
+ * Loader thread: claims slots in order and loads them, staying at most
+ * pl->window slots ahead of the emitter so open fds and buffered bodies
+ * stay bounded. Several loaders may run at once; slots complete out of
+ * order and the emitter waits on each in turn. With the io_uring engine
+ * each loader owns a ring and claims up to URING_BATCH slots at a time;
+ * if the ring cannot be set up it loads synchronously instead.
+ */
+static void *pipeline_loader(void *arg) {
+  Pipeline     *pl       = (Pipeline *)arg;
+  Uring        *ring     = NULL;
+  size_t        batch    = 1;
+  unsigned long syscalls = 0;
+  Boolean       used     = Falsehood;
+  Uring         ring_storage;
+
+  if (pl->engine == ENGINE_URING && uring_init(&ring_storage, 2 * URING_BATCH) == 0) {
+    ring  = &ring_storage;
+    batch = URING_BATCH;
+    used  = Truth;
+  }
+
+  pthread_mutex_lock(&pl->lock);
+  while (!pl->stop && pl->next_load < pl->count) {
+    size_t limit = pl->consumed + pl->window;
+    if (pl->next_load >= limit) {
+      pthread_cond_wait(&pl->cond, &pl->lock);
+      continue;
+    }
+    if (limit > pl->count) limit = pl->count;
+
+    size_t first = pl->next_load;
+    size_t n     = (limit - first < batch) ? limit - first : batch;
+    pl->next_load += n;
+    pthread_mutex_unlock(&pl->lock);
+
+    if (!ring || uring_load_slots(ring, &pl->slots[first], n, pl->zero_copy) != 0) {
+      for (size_t k = first; k < first + n; k++) {
+        load_slot(&pl->slots[k], pl->zero_copy);
+        syscalls += pl->slots[k].syscalls;
+      }
+    }
+    /* A ring that failed once is not trusted again */
+    if (ring && ring->error) {
+      syscalls += ring->syscalls;
+      uring_free(ring);
+      ring  = NULL;
+      batch = 1;
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    for (size_t k = first; k < first + n; k++) pl->slots[k].ready = Truth;
+    pthread_cond_broadcast(&pl->cond);
+  }
+  pl->syscalls += syscalls;
+  if (ring) pl->syscalls += ring->syscalls;
+  if (used) pl->uring_used = Truth;
+  pthread_mutex_unlock(&pl->lock);
+
+  if (ring) uring_free(ring);
+  return NULL;
+}
+
+/**
+ * Large files are never copied into the heap. On a zero-copy emitter the
+ * fd itself is kept for emit_file() (returns 1, fd now owned by the
+ * slot); otherwise a file of at least MMAP_READ_MIN bytes is mapped and
+ * emitted straight from its pages (returns 0, caller still closes fd).
+ * Returns -1 when the file should be read the ordinary way.
+ */
+static int take_large_body(FileSlot *slot, int fd, Boolean zero_copy) {
+  if (zero_copy && slot->size >= ZERO_COPY_MIN) {
+    slot->syscalls += 2;
+    if (count_mapped_lines(fd, slot->size, &slot->lines) == 0 && script_size_kept(slot, fd)) {
+      slot->fd = fd;
+      return 1;
+    }
+  } else if (slot->size >= MMAP_READ_MIN) {
+    slot->syscalls += 2;
+    slot->contents = map_script(fd, slot->size);
+    if (slot->contents && count_guarded_lines(slot->contents, slot->size, &slot->lines) == 0 &&
+        script_size_kept(slot, fd)) {
+      slot->mapped = Truth;
+      return 0;
+    }
+    if (slot->contents) munmap(slot->contents, slot->size);
+    slot->contents = NULL;
+    slot->lines    = 0;
+  }
+  return -1;
+}
+
+/**
+ * Re-sizes a script once its mapping has been counted: an editor that
+ * truncated and rewrote it meanwhile would leave the count, and the pages
+ * behind the mapping, out of date. Returns false, with slot->size set to
+ * the new size, when the file should be read the ordinary way instead.
+ */
+static Boolean script_size_kept(FileSlot *slot, int fd) {
+  struct stat st;
+
+  slot->syscalls++;
+  if (fstat(fd, &st) != 0) return Falsehood;
+  if ((size_t)st.st_size == slot->size) return Truth;
+  slot->size = (size_t)st.st_size;
+  return Falsehood;
+}
+
+/**
+ * Loads a body that is reused from the previous cached bundle. Small
+ * bodies are pread() into the heap so they are emitted in the same
+ * writev() batches as freshly read files; large ones stay in the old
+ * bundle's fd and are copied by emit_file() at their offset.
+ */
+static void load_borrowed_body(FileSlot *slot) {
+  size_t got = 0;
+
+  if (slot->size >= MMAP_READ_MIN) return;
+  slot->contents = malloc(slot->size + 1);
+  if (!slot->contents) {
+    fprintf(stderr, "Error allocating memory for file '%s/%s'\n", slot->source->path, slot->name);
+    slot->failed = Truth;
+    return;
+  }
+  while (got < slot->size) {
+    ssize_t n = pread(slot->fd, slot->contents + got, slot->size - got, slot->offset + (off_t)got);
+    slot->syscalls++;
+    if (n > 0) { got += (size_t)n; continue; }
+    if (n < 0 && errno == EINTR) continue;
+    fprintf(stderr, "Error reading cached bundle for '%s/%s'\n", slot->source->path, slot->name);
+    free(slot->contents);
+    slot->contents = NULL;
+    slot->failed   = Truth;
+    return;
+  }
+  slot->contents[got] = '\0';
+  slot->fd            = -1;
+}
+
+/* Closes or frees whatever body a slot still holds. */
+static void release_slot(FileSlot *slot) {
+  if (slot->fd >= 0 && !slot->borrowed) close(slot->fd);
+  if (slot->mapped) munmap(slot->contents, slot->size);
+  else              free(slot->contents);
+  slot->fd       = -1;
+  slot->contents = NULL;
+  slot->mapped   = Falsehood;
+}
+
+/**
+ * Readahead thread: walks the slots in bundle order and asks the kernel to
+ * start reading each file in the background, so a cold page cache is
+ * filled by parallel disk I/O instead of one blocking read per file.
+ * Slots a loader has already claimed are skipped, since hinting them
+ * would only add syscalls ahead of a read that is already under way.
+ */
+static void *readahead_hints(void *arg) {
+  Pipeline *pl = (Pipeline *)arg;
+  size_t    i  = 0;
+
+  while (i < pl->count) {
+    pthread_mutex_lock(&pl->lock);
+    Boolean stop = pl->stop;
+    if (i < pl->next_load) i = pl->next_load;
+    pthread_mutex_unlock(&pl->lock);
+    if (stop || i >= pl->count) break;
+
+    const FileSlot *slot = &pl->slots[i++];
+    if (slot->borrowed) continue;
+    int fd = openat(slot->source->sd.dir_fd, slot->name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) continue;
+#ifdef POSIX_FADV_WILLNEED
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0) pl->hinted++;
+#elif defined(F_RDADVISE)
+    struct stat     st;
+    struct radvisory ra;
+    if (fstat(fd, &st) == 0) {
+      ra.ra_offset = 0;
+      ra.ra_count  = st.st_size > INT_MAX ? INT_MAX : (int)st.st_size;
+      if (fcntl(fd, F_RDADVISE, &ra) == 0) pl->hinted++;
+    }
+#endif
+    close(fd);
+  }
+  return NULL;
+}
+
+/**
+ * Emits one loaded slot: section header, body, trailing newline. Updates
+ * line_offset so that _SCRIPTSORT_OFFSET values reflect real bundle line
+ * numbers. Ownership of the slot's fd or buffer passes to this call.
+ * When timed, the header first closes the previous file's lap (see
+ * BUNDLE_TIMER_START). *body_offset receives the position of the body
+ * within the bundle.
+ */
+static int bundle_append_file(Emitter *em, FileSlot *slot, int *line_offset,
+                              Boolean timed, uint64_t *body_offset) {
+  const char *dir_label = slot->source->label;
+
+  /* Header is 4 lines: blank + comment + _FILE + _OFFSET */
+  int file_start = *line_offset + 5;
+  int file_end   = file_start + (slot->lines > 0 ? (int)slot->lines - 1 : 0);
+  *line_offset = file_end + 1;
+
+  int rc = emit_text(em, BUNDLE_FILE_HEADER, dir_label, slot->name, file_start, file_end, timed ? "_scriptsort_lap; " : "",
+    dir_label, slot->name, file_start);
+  *body_offset = em->total;
+
+  if (slot->fd >= 0) {
+    if (rc == 0) rc = emit_file(em, slot->fd, slot->offset, slot->size);
+    release_slot(slot);
+  } else if (rc != 0) {
+    release_slot(slot);
+  } else {
+    if (slot->mapped) rc = emit_mapped(em, slot->contents, slot->size);
+    else              rc = emit_owned(em, slot->contents, slot->size);
+    slot->contents = NULL;
+    slot->mapped   = Falsehood;
+  }
+
+  if (rc != 0 || emit_text(em, "\n") != 0) return -1;
+  return em->stream ? emit_flush(em) : 0;
+}
+
+/**
+ * Emits every file of every source in order (each source lower →
+ * unordered → upper). jobs loader threads open, stat and read files
+ * concurrently into per-file slots while earlier files are written, so
+ * on a high-latency filesystem wall time tracks the slowest file rather
+ * than the sum, and a streaming reader can start parsing the first file
+ * early. If no thread can be started, files are loaded inline. With
+ * opts->readahead a separate thread hints every file to the kernel up
+ * front. Per-run counters are added to stats.
+ *
+ * When building a cache entry, files the cache marked unchanged are not
+ * loaded at all: their bodies are copied from the previous bundle, and
+ * every file's new body offset and line count go back into its segment.
+ */
+static int bundle_append_dirs(BundleSource *sources, int source_count, Emitter *em,
+                              int *line_offset, Boolean timed, const LoadOptions *opts,
+                              LoadStats *stats, BundleCache *cache) {
+  int      jobs  = opts->jobs;
+  Pipeline pl;
+  size_t   total = 0;
+  int      rc    = 0;
+
+  memset(&pl, 0, sizeof(pl));
+  for (int s = 0; s < source_count; s++) total += sources[s].sd.count;
+  if (total == 0) return 0;
+
+  pl.slots = calloc(total, sizeof(FileSlot));
+  if (!pl.slots) {
+    fprintf(stderr, "Cannot allocate %zu bundle slots\n", total);
+    return -1;
+  }
+  for (int s = 0; s < source_count; s++) {
+    for (size_t i = 0; i < sources[s].sd.count; i++) {
+      FileSlot *slot = &pl.slots[pl.count++];
+      slot->source = &sources[s];
+      slot->name   = entry_name(&sources[s].sd, &sources[s].sd.entries[i]);
+      slot->fd     = -1;
+
+      const Segment *seg = (cache && cache->segments) ? &cache->segments[pl.count - 1] : NULL;
+      if (seg && seg->reuse >= 0) {
+        slot->fd       = cache->old_fd;
+        slot->offset   = (off_t)seg->reuse;
+        slot->size     = (size_t)seg->size;
+        slot->lines    = seg->lines;
+        slot->borrowed = Truth;
+      }
+    }
+  }
+  pl.zero_copy = (em->transfer != TRANSFER_BUFFERED);
+  pl.engine    = opts->engine;
+  pl.window    = (size_t)jobs * 4 > PREFETCH_WINDOW ? (size_t)jobs * 4 : PREFETCH_WINDOW;
+  /* Each ring keeps one batch in flight while the previous one is emitted */
+  if (pl.engine == ENGINE_URING) pl.window = (size_t)jobs * 2 * URING_BATCH;
+
+  pthread_mutex_init(&pl.lock, NULL);
+  pthread_cond_init(&pl.cond, NULL);
+
+  pthread_t hint_thread;
+  Boolean   hinting = (opts->readahead && pl.count > 1 &&
+                       pthread_create(&hint_thread, NULL, readahead_hints, &pl) == 0);
+
+  if (pl.count > 1 || pl.engine == ENGINE_URING) {
+    for (int t = 0; t < jobs && (size_t)t < pl.count; t++) {
+      if (pthread_create(&pl.threads[pl.thread_count], NULL, pipeline_loader, &pl) != 0) break;
+      pl.thread_count++;
+    }
+  }
+
+  for (size_t i = 0; i < pl.count; i++) {
+    FileSlot *slot = &pl.slots[i];
+
+    if (pl.thread_count > 0) {
+      pthread_mutex_lock(&pl.lock);
+      while (!slot->ready) pthread_cond_wait(&pl.cond, &pl.lock);
+      pthread_mutex_unlock(&pl.lock);
+    } else {
+      load_slot(slot, pl.zero_copy);
+      pl.syscalls += slot->syscalls;
+    }
+
+    if (slot->failed) {
+      stats->failed++;
+    } else {
+      Segment *seg      = (cache && cache->segments) ? &cache->segments[i] : NULL;
+      uint64_t body_at  = 0;
+      size_t   size     = slot->size;
+      size_t   lines    = slot->lines;
+      Boolean  borrowed = slot->borrowed;
+
+      stats->files++;
+      stats->bytes  += size;
+      stats->reused += borrowed ? 1 : 0;
+      if (bundle_append_file(em, slot, line_offset, timed, &body_at) != 0) {
+        rc = -1;
+        break;
+      }
+      if (seg) {
+        seg->offset = body_at;
+        seg->lines  = lines;
+        /* Changed between stat and read: never let this record match */
+        if (size != seg->size) seg->mtime_ns = -1;
+      }
+    }
+
+    pthread_mutex_lock(&pl.lock);
+    pl.consumed = i + 1;
+    pthread_cond_broadcast(&pl.cond);
+    pthread_mutex_unlock(&pl.lock);
+  }
+
+  if (pl.thread_count > 0 || hinting) {
+    pthread_mutex_lock(&pl.lock);
+    pl.stop = Truth;
+    pthread_cond_broadcast(&pl.cond);
+    pthread_mutex_unlock(&pl.lock);
+    for (int t = 0; t < pl.thread_count; t++) pthread_join(pl.threads[t], NULL);
+    if (hinting) pthread_join(hint_thread, NULL);
+  }
+  stats->hinted    += pl.hinted;
+  stats->syscalls  += pl.syscalls;
+  stats->uring_used = stats->uring_used || pl.uring_used;
+
+  /* Release anything prefetched but never emitted (write failure) */
+  for (size_t i = 0; i < pl.count; i++) release_slot(&pl.slots[i]);
+  pthread_cond_destroy(&pl.cond);
+  pthread_mutex_destroy(&pl.lock);
+  free(pl.slots);
+  return rc;
+}
+
+/* =========================================================================
+ * list subcommand
+ * ====================================================================== */
+
+static int list_main(int argc, char **argv) {
   const char  *directory    = NULL;
-  Boolean      debugtext    = Falsehood;
   unsigned int cutoff_count = 50;
 
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-      print_subcommand_help("scriptsort", find_subcommand("init"));
+      print_subcommand_help("scriptsort", find_subcommand("list"));
+      return EXIT_SUCCESS;
+    } else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n <= 0) {
+        fprintf(stderr, SGR_RED "--cutoff requires a number greater than 0\n" SGR_RESET);
+        return EXIT_FAILURE;
+      }
+      cutoff_count = (unsigned int)n;
+    } else if (argv[i][0] != '-' && !directory) {
+      directory = argv[i];
+    } else {
+      fprintf(stderr, SGR_RED "Unknown argument: %s\n" SGR_RESET, argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!directory) {
+    print_subcommand_help("scriptsort", find_subcommand("list"));
+    return EXIT_FAILURE;
+  }
+
+  SortedDir sd;
+  if (load_sorted_dir(directory, cutoff_count, &sd) != 0)
+    return EXIT_FAILURE;
+
+  String buffer = calloc(1, sd.total_bytesize + 1);
+  if (!buffer) {
+    fprintf(stderr, "Cannot allocate buffer\n");
+    free_sorted_dir(&sd);
+    return EXIT_FAILURE;
+  }
+
+  size_t cur = 0;
+  for (size_t i = 0; i < sd.count; i++)
+    cur += (size_t)sprintf(buffer + cur, "%s\n", entry_name(&sd, &sd.entries[i]));
+  free_sorted_dir(&sd);
+
+  printf("%s", buffer);
+  free(buffer);
+  return EXIT_SUCCESS;
+}
+
+/* =========================================================================
+ * bundle subcommand
+ * ====================================================================== */
+
+static int bundle_main(int argc, char **argv) {
+  const char  *directory        = NULL;
+  const char  *scripts_dir      = NULL;
+  const char  *shell_override   = NULL;
+  Boolean      debugtext        = Falsehood;
+  unsigned int cutoff_count     = 50;
+  LoadOptions  load             = { 1, ENGINE_SYNC, Falsehood };
+  LoadStats    stats;
+  Boolean      show_stats       = Falsehood;
+  Boolean      use_cache        = Falsehood;
+  Boolean      refresh          = Falsehood;
+  int          max_stale        = -1;
+  const char  *output_path      = NULL;
+  Boolean      use_daemon       = Truth;
+  struct timespec started;
+
+  memset(&stats, 0, sizeof(stats));
+  stats.cache = "off";
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      print_subcommand_help("scriptsort", find_subcommand("bundle"));
       return EXIT_SUCCESS;
+    } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--scripts-dir") == 0) && i + 1 < argc) {
+      scripts_dir = argv[++i];
+    } else if (strcmp(argv[i], "--zsh") == 0) {
+      shell_override = SUB_ZSH;
+    } else if (strcmp(argv[i], "--bash") == 0) {
+      shell_override = SUB_BASH;
     } else if (strcmp(argv[i], "--debug") == 0) {
       debugtext = Truth;
     } else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc) {
@@ -643,7 +1948,43 @@ static int init_main(int argc, char **argv) {
         return EXIT_FAILURE;
       }
       cutoff_count = (unsigned int)n;
-    } else if (argv[i][0] != '-' && !directory) {
+    } else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n <= 0 || n > MAX_JOBS) {
+        fprintf(stderr, SGR_RED "--jobs requires a number from 1 to %d\n" SGR_RESET, MAX_JOBS);
+        return EXIT_FAILURE;
+      }
+      load.jobs = n;
+    } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+      i++;
+      if      (strcmp(argv[i], "sync")  == 0) load.engine = ENGINE_SYNC;
+      else if (strcmp(argv[i], "uring") == 0) load.engine = ENGINE_URING;
+      else {
+        fprintf(stderr, SGR_RED "--io requires sync or uring\n" SGR_RESET);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--readahead") == 0) {
+      load.readahead = Truth;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      show_stats = Truth;
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      use_cache = Truth;
+    } else if (strcmp(argv[i], "--max-stale") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n <= 0) {
+        fprintf(stderr, SGR_RED "--max-stale requires a number of seconds greater than 0\n" SGR_RESET);
+        return EXIT_FAILURE;
+      }
+      max_stale = n;
+      use_cache = Truth;
+    } else if (strcmp(argv[i], "--refresh") == 0) {
+      refresh   = Truth;
+      use_cache = Truth;
+    } else if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (strcmp(argv[i], "--no-daemon") == 0) {
+      use_daemon = Falsehood;
+    } else if (argv[i][0] != '-' && !directory && !scripts_dir) {
       directory = argv[i];
     } else {
       fprintf(stderr, SGR_RED "Unknown argument: %s\n" SGR_RESET, argv[i]);
@@ -651,295 +1992,3128 @@ static int init_main(int argc, char **argv) {
     }
   }
 
-  if (!directory) {
-    print_subcommand_help("scriptsort", find_subcommand("init"));
-    return EXIT_FAILURE;
+  if (scripts_dir && directory) {
+    fprintf(stderr, SGR_RED "--scripts-dir and <directory> are mutually exclusive\n" SGR_RESET);
+    return EXIT_FAILURE;
+  }
+  if (shell_override && !scripts_dir) {
+    fprintf(stderr, SGR_RED "--zsh/--bash require --scripts-dir (-s)\n" SGR_RESET);
+    return EXIT_FAILURE;
+  }
+  if (!scripts_dir && !directory) {
+    print_subcommand_help("scriptsort", find_subcommand("bundle"));
+    return EXIT_FAILURE;
+  }
+
+  BundleSpec   spec         = { directory, scripts_dir, NULL, cutoff_count, debugtext };
+  BundleSource sources[2];
+  int          source_count = 0;
+  BundleCache  cache;
+  Boolean      caching      = Falsehood;
+  Boolean      revalidating = Falsehood;
+  int          out_fd       = STDOUT_FILENO;
+  int          status       = EXIT_SUCCESS;
+  OutputFile   output;
+  Emitter      em;
+
+  if (scripts_dir) spec.shell_subdir = detect_shell_subdir(shell_override);
+
+  /* With --output, stdout is the replacement file from here on */
+  if (output_path && output_begin(&output, output_path) != 0) return EXIT_FAILURE;
+
+  emit_init(&em, STDOUT_FILENO);
+
+  /* A serve daemon answers plain bundles from memory, without touching any
+   * script; --cache, --max-stale, --refresh and --output ask for this
+   * process's own cache entry or file, so they never depend on one running */
+  if (scripts_dir && use_daemon && !use_cache && !output_path) {
+    int served = daemon_fetch(&spec, &em, &stats);
+    if (served <= 0) {
+      stats.cache = "daemon";
+      if (served == 0 && show_stats) print_bundle_stats(&stats, &load, &started);
+      status = served == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+      goto finish;
+    }
+  }
+
+  if (use_cache && cache_open(&cache, &spec) == 0) {
+    caching = Truth;
+
+    /* A recently validated entry is served before any script is looked at */
+    if (max_stale > 0 && !refresh) {
+      int served = cache_serve_stale(&cache, &em, (unsigned int)max_stale, &stats);
+      if (served < 0) {
+        status = EXIT_FAILURE;
+        goto finish;
+      }
+      if (served == 0) {
+        stats.cache = "stale";
+        if (!detach_revalidation()) {
+          if (show_stats) print_bundle_stats(&stats, &load, &started);
+          goto finish;
+        }
+        /* Detached: validate as usual, with stdout now on /dev/null */
+        revalidating = Truth;
+        memset(&stats, 0, sizeof(stats));
+        emit_init(&em, STDOUT_FILENO);
+      }
+    }
+  }
+
+  /* Directory mtimes are taken here, before the cache is checked or any scan */
+  if (caching && cache_stamp_base(&cache, &spec) != 0) {
+    cache_close(&cache);
+    caching = Falsehood;
+  }
+  source_count = plan_bundle_sources(&spec, sources);
+
+  if (caching) {
+    int served = refresh ? 1 : cache_serve(&cache, &em, &stats);
+
+    /* Single flight: one process rebuilds a stale entry while the others
+     * wait for its lock, then serve what it published. A background
+     * revalidation just leaves if another one is already running. */
+    if (served == 1) {
+      int locked = cache_lock(&cache, !revalidating);
+      if (locked == 1) {
+        cache_close(&cache);
+        free_bundle_sources(sources, source_count);
+        goto finish;
+      }
+      if (locked == 2 && !refresh) served = cache_serve(&cache, &em, &stats);
+    }
+    if (served <= 0) {
+      /* A validated entry restarts the --max-stale window */
+      if (max_stale > 0 && served == 0) utimensat(AT_FDCWD, cache.manifest_path, NULL, 0);
+      stats.cache = "hit";
+      if (show_stats) print_bundle_stats(&stats, &load, &started);
+      cache_close(&cache);
+      status = served == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+      goto finish;
+    }
+    stats.cache = refresh ? "refresh" : "miss";
+  }
+
+  /* Single-directory mode fails before any output if the directory is bad */
+  if (directory && scan_bundle_sources(sources, 1, cutoff_count, load.jobs) != 1) {
+    if (caching) cache_close(&cache);
+    status = EXIT_FAILURE;
+    goto finish;
+  }
+
+  /* A cache miss is generated into the cache, then served from there */
+  if (caching) {
+    out_fd = cache_begin(&cache);
+    if (out_fd < 0) {
+      fprintf(stderr, "scriptsort: cannot write cache in '%s': %s; bundling uncached\n",
+              cache.dir, strerror(errno));
+      cache_close(&cache);
+      caching = Falsehood;
+      out_fd  = STDOUT_FILENO;
+    } else {
+      emit_init(&em, out_fd);
+    }
+  }
+
+  int rc = bundle_generate(&em, &spec, sources, &source_count, &load, &stats,
+                           caching ? &cache : NULL);
+
+  if (caching) {
+    /* Only a complete bundle is published; a file that failed to load
+     * would otherwise stay missing until its metadata changed. */
+    Boolean complete = (rc == 0 && stats.failed == 0);
+    Emitter out;
+    struct stat st;
+
+    if (complete && cache_publish(&cache, out_fd) != 0)
+      fprintf(stderr, "scriptsort: cannot publish cache in '%s': %s\n", cache.dir, strerror(errno));
+    /* Waiting shells can serve the new entry while this one copies it out */
+    cache_unlock(&cache);
+    emit_init(&out, STDOUT_FILENO);
+    if (rc == 0 && !revalidating && (fstat(out_fd, &st) != 0 || emit_file(&out, out_fd, 0, (size_t)st.st_size) != 0))
+      rc = -1;
+    close(out_fd);
+    cache_close(&cache);
+  }
+  free_bundle_sources(sources, source_count);
+  if (rc != 0) status = EXIT_FAILURE;
+  else if (show_stats) print_bundle_stats(&stats, &load, &started);
+
+finish:
+  /* A detached revalidation leaves the output to the process that served it */
+  if (output_path && !revalidating) {
+    if      (status != EXIT_SUCCESS)      output_abort(&output);
+    else if (output_commit(&output) != 0) status = EXIT_FAILURE;
+  }
+  return status;
+}
+
+/**
+ * Picks the shell-specific sub-directory to include after shared/.
+ *
+ * An explicit --zsh or --bash flag takes priority over auto-detection.
+ * Auto-detection checks ZSH_VERSION / BASH_VERSION first (definitive when
+ * exported), then falls back to $SHELL basename (always exported, correct
+ * for the common case where login shell == current shell).
+ */
+static const char *detect_shell_subdir(const char *shell_override) {
+  if (shell_override)         return shell_override;
+  if (getenv("ZSH_VERSION"))  return SUB_ZSH;
+  if (getenv("BASH_VERSION")) return SUB_BASH;
+
+  const char *shell = getenv("SHELL");
+  if (shell) {
+    const char *name = find_last_path_separator(shell);
+    name = name ? name + 1 : shell;
+    if      (strcmp(name, "zsh")  == 0) return SUB_ZSH;
+    else if (strcmp(name, "bash") == 0) return SUB_BASH;
+  }
+  return NULL;
+}
+
+/**
+ * Fills sources with the directories spec bundles, in output order, each
+ * stamped with its mtime before it is scanned. In -s mode sub-directories
+ * that do not exist are left out. Returns the number of sources.
+ */
+static int plan_bundle_sources(const BundleSpec *spec, BundleSource *sources) {
+  const char *paths[2];
+  char        shared[PATH_MAX];
+  char        shell[PATH_MAX];
+  int         want  = 0;
+  int         count = 0;
+  struct stat st;
+
+  if (spec->directory) {
+    paths[want++] = spec->directory;
+  } else {
+    /* shared/ — always first; the shell sub-directory only when detected */
+    snprintf(shared, sizeof(shared), "%s/" SUB_SHARED, spec->scripts_dir);
+    paths[want++] = shared;
+    if (spec->shell_subdir) {
+      snprintf(shell, sizeof(shell), "%s/%s", spec->scripts_dir, spec->shell_subdir);
+      paths[want++] = shell;
+    }
+  }
+
+  for (int i = 0; i < want; i++) {
+    Boolean is_dir = (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode));
+    if (!is_dir && spec->scripts_dir) continue;
+    init_bundle_source(&sources[count], paths[i]);
+    if (is_dir) sources[count].mtime_ns = stat_mtime_ns(&st);
+    count++;
+  }
+  return count;
+}
+
+/*
+ * The wrapper around every bundle is built from shell builtins only, so
+ * sourcing a bundle forks nothing of its own. It has to parse in both bash
+ * and zsh; syntax only one of them knows sits in a branch the other never
+ * runs, or inside an eval string.
+ */
+
+/*
+ * --debug start stamp. _scriptsort_lap reads $EPOCHREALTIME (native in
+ * bash 5, a module in zsh) as integer microseconds into _SCRIPTSORT_LAP and
+ * charges the time since its previous call to the file being sourced. The
+ * "seconds.fraction" stamp uses the locale's radix character in bash; the
+ * fraction is padded and cut to six digits. Every file header calls it.
+ */
+static const char BUNDLE_TIMER_START[] =
+  "[[ -n ${ZSH_VERSION-} ]] && zmodload zsh/datetime 2>/dev/null\n"
+  "typeset -gA SCRIPTSORT_TIMINGS\n"
+  "SCRIPTSORT_TIMINGS=()\n"
+  "_SCRIPTSORT_ORDER=()\n"
+  "_scriptsort_lap() {\n"
+  "  local now=${EPOCHREALTIME-} frac\n"
+  "  [[ -n $now ]] || return 0\n"
+  "  frac=${now#*[.,]}000000\n"
+  "  now=$(( ${now%%[.,]*} * 1000000 + 10#${frac:0:6} ))\n"
+  "  if [[ -n ${_SCRIPTSORT_FILE-} ]]; then\n"
+  "    SCRIPTSORT_TIMINGS[$_SCRIPTSORT_FILE]=$(( now - _SCRIPTSORT_LAP ))\n"
+  "    _SCRIPTSORT_ORDER+=(\"$_SCRIPTSORT_FILE\")\n"
+  "  fi\n"
+  "  _SCRIPTSORT_LAP=$now\n"
+  "}\n"
+  "_SCRIPTSORT_FILE=''\n"
+  "_scriptsort_lap\n"
+  "_SCRIPTSORT_START=${_SCRIPTSORT_LAP-}\n";
+
+/*
+ * Saves the caller's ERR trap for the footer to restore. Only bash 5.3 can
+ * read trap -p in the current shell, and zsh a TRAPZERR function through
+ * $functions; a zsh list trap (trap '...' ZERR) or older bash costs one
+ * $(trap) fork. zsh lists ZERR after every signal and before DEBUG, so
+ * its entry is the last "trap -- ... ZERR" once DEBUG is cut off.
+ */
+static const char BUNDLE_PREAMBLE[] =
+  "_SCRIPTSORT_OLD_TRAP=''\n"
+  "if [[ -n ${ZSH_VERSION-} ]]; then\n"
+  "  if (( ${+functions[TRAPZERR]} )); then\n"
+  "    _SCRIPTSORT_OLD_TRAP=\"functions[TRAPZERR]=${(q)functions[TRAPZERR]}\"\n"
+  "  else\n"
+  "    _SCRIPTSORT_OLD_TRAP=$'\\n'$(trap)\n"
+  "    _SCRIPTSORT_OLD_TRAP=${_SCRIPTSORT_OLD_TRAP%$'\\n'trap -- * DEBUG}\n"
+  "    _SCRIPTSORT_OLD_TRAP=${_SCRIPTSORT_OLD_TRAP%$'\\n'TRAPDEBUG*}\n"
+  "    _SCRIPTSORT_OLD_TRAP=${(M)_SCRIPTSORT_OLD_TRAP%$'\\n'trap -- * ZERR}\n"
+  "  fi\n"
+  "elif (( BASH_VERSINFO[0] * 100 + BASH_VERSINFO[1] >= 503 )); then\n"
+  "  eval '_SCRIPTSORT_OLD_TRAP=${ trap -p ERR; }'\n"
+  "else\n"
+  "  _SCRIPTSORT_OLD_TRAP=$(trap -p ERR)\n"
+  "fi\n"
+  "_SCRIPTSORT_FILE=''\n"
+  "_SCRIPTSORT_OFFSET=0\n"
+  "trap 'printf \"scriptsort: error sourcing \\\"${_SCRIPTSORT_FILE}\\\" "
+    "(bundle line ${_SCRIPTSORT_OFFSET})\\n\" >&2' ERR\n"
+  "\n";
+
+static const char BUNDLE_FOOTER[] =
+  "\n"
+  "\ntrap - ERR\n"
+  "eval \"$_SCRIPTSORT_OLD_TRAP\"\n"
+  "unset _SCRIPTSORT_OLD_TRAP _SCRIPTSORT_FILE _SCRIPTSORT_OFFSET\n";
+
+/*
+ * --debug end stamp, run after the footer has unset _SCRIPTSORT_FILE. With
+ * SCRIPTSORT_REPORT set while sourcing, the files are also listed on stderr
+ * by cost; only that opt-in report forks (for sort).
+ */
+static const char BUNDLE_TIMER_END[] =
+  "_scriptsort_lap\n"
+  "if [[ -n $_SCRIPTSORT_START ]]; then\n"
+  "  export SCRIPTSORT_ELAPSED_US=$(( _SCRIPTSORT_LAP - _SCRIPTSORT_START ))\n"
+  "else\n"
+  "  export SCRIPTSORT_ELAPSED_US=0\n"
+  "fi\n"
+  "export SCRIPTSORT_ELAPSED=$(( SCRIPTSORT_ELAPSED_US / 1000 ))\n"
+  "if [[ -n ${SCRIPTSORT_REPORT-} ]]; then\n"
+  "  for _SCRIPTSORT_FILE in \"${_SCRIPTSORT_ORDER[@]}\"; do\n"
+  "    printf '%10d us  %s\\n' \"${SCRIPTSORT_TIMINGS[$_SCRIPTSORT_FILE]}\" \"$_SCRIPTSORT_FILE\"\n"
+  "  done | sort -rn >&2\n"
+  "  printf '%10d us  total\\n' \"$SCRIPTSORT_ELAPSED_US\" >&2\n"
+  "fi\n"
+  "unset -f _scriptsort_lap\n"
+  "unset _SCRIPTSORT_START _SCRIPTSORT_LAP _SCRIPTSORT_ORDER _SCRIPTSORT_FILE\n";
+
+/**
+ * Writes a complete bundle for spec to em: timing and trap preamble, every
+ * source's files, then the footer. In -s mode the sources are scanned here,
+ * after the preamble has been flushed to a streaming reader; those that
+ * fail to scan are dropped from *source_count. When cache is given, file
+ * metadata for its manifest is recorded between scanning and loading.
+ */
+static int bundle_generate(Emitter *em, const BundleSpec *spec, BundleSource *sources,
+                           int *source_count, const LoadOptions *load, LoadStats *stats,
+                           BundleCache *cache) {
+  /* Bundle line numbers continue from wherever the preamble ends */
+  int line_offset = (int)count_newlines(BUNDLE_PREAMBLE, sizeof(BUNDLE_PREAMBLE) - 1);
+
+  if (spec->debug) {
+    if (emit_text(em, "%s", BUNDLE_TIMER_START) != 0) return -1;
+    line_offset += (int)count_newlines(BUNDLE_TIMER_START, sizeof(BUNDLE_TIMER_START) - 1);
+  }
+  if (emit_text(em, "%s", BUNDLE_PREAMBLE) != 0) return -1;
+
+  /* A streaming reader can start on the preamble before any file is read */
+  if (em->stream && emit_flush(em) != 0) return -1;
+
+  /* Both directories are scanned concurrently when jobs allow */
+  if (spec->scripts_dir)
+    *source_count = scan_bundle_sources(sources, *source_count, spec->cutoff, load->jobs);
+
+  /* Without a record the entry is simply not published */
+  if (cache) cache_record_sources(cache, sources, *source_count);
+
+  if (bundle_append_dirs(sources, *source_count, em, &line_offset, spec->debug, load, stats, cache) != 0)
+    return -1;
+
+  /* The last file's lap closes before the footer unsets _SCRIPTSORT_FILE */
+  if (spec->debug && emit_text(em, "_scriptsort_lap\n") != 0) return -1;
+  if (emit_text(em, "%s", BUNDLE_FOOTER) != 0) return -1;
+  if (spec->debug && emit_text(em, "%s", BUNDLE_TIMER_END) != 0) return -1;
+
+  return emit_flush(em);
+}
+
+/* Prints the one-line --stats summary to stderr. */
+static void print_bundle_stats(const LoadStats *stats, const LoadOptions *load,
+                               const struct timespec *started) {
+  struct timespec finished;
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+  double wall_ms = (double)(finished.tv_sec - started->tv_sec) * 1e3 +
+                   (double)(finished.tv_nsec - started->tv_nsec) / 1e6;
+  fprintf(stderr, "scriptsort: engine=%s jobs=%d readahead=%s cache=%s files=%zu bytes=%zu "
+                  "reused=%zu syscalls=%lu hinted=%zu wall=%.3fms\n",
+          stats->uring_used ? "uring" : "sync", load->jobs, load->readahead ? "on" : "off",
+          stats->cache, stats->files, stats->bytes, stats->reused, stats->syscalls,
+          stats->hinted, wall_ms);
+}
+
+/* =========================================================================
+ * init subcommand
+ * ====================================================================== */
+
+static int init_main(int argc, char **argv) {
+  const char  *directory    = NULL;
+  Boolean      debugtext    = Falsehood;
+  unsigned int cutoff_count = 50;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      print_subcommand_help("scriptsort", find_subcommand("init"));
+      return EXIT_SUCCESS;
+    } else if (strcmp(argv[i], "--debug") == 0) {
+      debugtext = Truth;
+    } else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n <= 0) {
+        fprintf(stderr, SGR_RED "--cutoff requires a number greater than 0\n" SGR_RESET);
+        return EXIT_FAILURE;
+      }
+      cutoff_count = (unsigned int)n;
+    } else if (argv[i][0] != '-' && !directory) {
+      directory = argv[i];
+    } else {
+      fprintf(stderr, SGR_RED "Unknown argument: %s\n" SGR_RESET, argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!directory) {
+    print_subcommand_help("scriptsort", find_subcommand("init"));
+    return EXIT_FAILURE;
+  }
+
+  /* Paths are resolved here, once, instead of by the shell for every file */
+  char      real[PATH_MAX];
+  SortedDir sd;
+  if (!realpath(directory, real)) {
+    fprintf(stderr, "scriptsort: cannot resolve '%s': %s\n", directory, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (load_sorted_dir(real, cutoff_count, &sd) != 0)
+    return EXIT_FAILURE;
+
+  printf("includeScripts() {\n"
+         "  local script\n");
+  /* --debug clocks each file with $EPOCHREALTIME, as bundle --debug does */
+  if (debugtext) {
+    printf("  local now frac started\n"
+           "  [[ -n ${ZSH_VERSION-} ]] && zmodload zsh/datetime 2>/dev/null\n"
+           "  typeset -gA SCRIPTSORT_TIMINGS\n"
+           "  SCRIPTSORT_TIMINGS=()\n");
+  }
+  printf("\n  for script in");
+  for (size_t i = 0; i < sd.count; i++) {
+    char path[PATH_MAX * 2];
+    snprintf(path, sizeof(path), "%s/%s", real, entry_name(&sd, &sd.entries[i]));
+    printf(" \\\n    ");
+    print_shell_quoted(path);
+  }
+  printf("\n  do\n");
+  free_sorted_dir(&sd);
+
+  if (debugtext) {
+    printf("    printf \"Sourcing \\\"%%s\\\"...\" \"${script}\"\n"
+           "    now=${EPOCHREALTIME-0.0}; frac=${now#*[.,]}000000\n"
+           "    started=$(( ${now%%%%[.,]*} * 1000000 + 10#${frac:0:6} ))\n"
+           "    source \"${script}\"\n"
+           "    now=${EPOCHREALTIME-0.0}; frac=${now#*[.,]}000000\n"
+           "    SCRIPTSORT_TIMINGS[$script]=$(( ${now%%%%[.,]*} * 1000000 + 10#${frac:0:6} - started ))\n"
+           "    printf \"done (%%dus)\\n\" \"${SCRIPTSORT_TIMINGS[$script]}\"\n");
+  } else {
+    printf("    source \"${script}\"\n");
+  }
+  printf("  done\n"
+         "}\n\n"
+         "includeScripts\n"
+         "unset -f includeScripts\n");
+  return EXIT_SUCCESS;
+}
+
+/* =========================================================================
+ * hook subcommand
+ * ====================================================================== */
+
+/* Prints s as a single-quoted shell word. */
+static void print_shell_quoted(const char *s) {
+  putchar('\'');
+  for (; *s; s++) {
+    if (*s == '\'') fputs("'\\''", stdout);
+    else            putchar(*s);
+  }
+  putchar('\'');
+}
+
+/**
+ * Prints a startup snippet that sources the cached bundle directly while
+ * it is newer than every directory it was built from, using nothing but
+ * the shell's own [[ -nt ]] test. Only a stale or missing cache runs
+ * scriptsort, which rebuilds the entry through bundle --cache.
+ */
+static int hook_main(int argc, char **argv) {
+  const char  *directory      = NULL;
+  const char  *scripts_dir    = NULL;
+  const char  *shell_override = NULL;
+  Boolean      debugtext      = Falsehood;
+  unsigned int cutoff_count   = 50;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      print_subcommand_help("scriptsort", find_subcommand("hook"));
+      return EXIT_SUCCESS;
+    } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--scripts-dir") == 0) && i + 1 < argc) {
+      scripts_dir = argv[++i];
+    } else if (strcmp(argv[i], "--zsh") == 0) {
+      shell_override = SUB_ZSH;
+    } else if (strcmp(argv[i], "--bash") == 0) {
+      shell_override = SUB_BASH;
+    } else if (strcmp(argv[i], "--debug") == 0) {
+      debugtext = Truth;
+    } else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n <= 0) {
+        fprintf(stderr, SGR_RED "--cutoff requires a number greater than 0\n" SGR_RESET);
+        return EXIT_FAILURE;
+      }
+      cutoff_count = (unsigned int)n;
+    } else if (argv[i][0] != '-' && !directory && !scripts_dir) {
+      directory = argv[i];
+    } else {
+      fprintf(stderr, SGR_RED "Unknown argument: %s\n" SGR_RESET, argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (scripts_dir && directory) {
+    fprintf(stderr, SGR_RED "--scripts-dir and <directory> are mutually exclusive\n" SGR_RESET);
+    return EXIT_FAILURE;
+  }
+  if (shell_override && !scripts_dir) {
+    fprintf(stderr, SGR_RED "--zsh/--bash require --scripts-dir (-s)\n" SGR_RESET);
+    return EXIT_FAILURE;
+  }
+  if (!scripts_dir && !directory) {
+    print_subcommand_help("scriptsort", find_subcommand("hook"));
+    return EXIT_FAILURE;
+  }
+
+  BundleSpec   spec = { directory, scripts_dir, NULL, cutoff_count, debugtext };
+  BundleSource sources[2];
+  BundleCache  cache;
+  char         real[PATH_MAX];
+  char         absolute[PATH_MAX];
+
+  /* The snippet's fallback must key the entry as this run does: by the
+   * absolute path as given, symlinks and all, like bundle_key() */
+  if (absolute_path(scripts_dir ? scripts_dir : directory, absolute, sizeof(absolute)) == 0) {
+    if (scripts_dir) spec.scripts_dir = absolute;
+    else             spec.directory   = absolute;
+  }
+  if (scripts_dir) spec.shell_subdir = detect_shell_subdir(shell_override);
+  if (cache_open(&cache, &spec) != 0 || cache_stamp_base(&cache, &spec) != 0) {
+    fprintf(stderr, "scriptsort: cannot locate the bundle cache for '%s'\n",
+            scripts_dir ? scripts_dir : directory);
+    return EXIT_FAILURE;
+  }
+  int source_count = plan_bundle_sources(&spec, sources);
+
+  /* The base directory's mtime covers sub-directories created later */
+  const char *joiner = "if [[ ";
+  printf("# scriptsort: source the cached bundle while it is newer than its directories\n");
+  for (int s = -1; s < source_count; s++) {
+    if (s < 0 && !cache.base_path[0]) continue;
+    if (s >= 0 && !realpath(sources[s].path, real)) continue;
+    printf("%s", joiner);
+    print_shell_quoted(cache.bundle_path);
+    printf(" -nt ");
+    print_shell_quoted(s < 0 ? cache.base_path : real);
+    joiner = " && ";
+  }
+
+  printf(" ]]; then\n  source ");
+  print_shell_quoted(cache.bundle_path);
+  printf("\nelse\n  source <(scriptsort bundle ");
+  if (scripts_dir) {
+    printf("-s ");
+    print_shell_quoted(spec.scripts_dir);
+  } else {
+    print_shell_quoted(spec.directory);
+  }
+  if (spec.shell_subdir) printf(" --%s", spec.shell_subdir);
+  if (cutoff_count != 50) printf(" --cutoff %u", cutoff_count);
+  if (debugtext)          printf(" --debug");
+  printf(" --cache)\nfi\n");
+
+  free_bundle_sources(sources, source_count);
+  cache_close(&cache);
+  return EXIT_SUCCESS;
+}
+
+/* =========================================================================
+ * watch subcommand
+ *
+ * Keeps each shell's bundle regenerated as scripts change: one inotify
+ * watch on the base directory (shared/ or a shell sub-directory appearing
+ * or going away) and one on each sub-directory. Events are debounced, and
+ * only the variants a change can affect are rebuilt, each through the
+ * ordinary bundle --cache path, so hooks and bundle --cache are always hits.
+ * ====================================================================== */
+
+#ifdef __linux__
+
+/**
+ * Regenerates one shell's bundle into the cache and, when output is set,
+ * into that file. Returns the bundle run's exit status.
+ */
+static int watch_rebuild(const char *scripts_dir, const char *shell, const char *output,
+                         unsigned int cutoff, Boolean debug, int null_fd) {
+  char            shell_flag[16];
+  char            cutoff_arg[16];
+  char           *args[12];
+  int             n = 0;
+  struct timespec started;
+  struct timespec finished;
+
+  snprintf(shell_flag, sizeof(shell_flag), "--%s", shell);
+  snprintf(cutoff_arg, sizeof(cutoff_arg), "%u", cutoff);
+  args[n++] = "bundle";
+  args[n++] = "-s";
+  args[n++] = (char *)scripts_dir;
+  args[n++] = shell_flag;
+  args[n++] = "--cutoff";
+  args[n++] = cutoff_arg;
+  args[n++] = "--cache";
+  args[n++] = "--no-daemon";
+  if (debug)  args[n++] = "--debug";
+  if (output) {
+    args[n++] = "--output";
+    args[n++] = (char *)output;
+  }
+  args[n] = NULL;
+
+  /* --output moves stdout onto its file; everything else goes nowhere */
+  dup2(null_fd, STDOUT_FILENO);
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  int rc = bundle_main(n, args);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+
+  fprintf(stderr, "scriptsort: %s %s bundle in %.3fms\n",
+          rc == EXIT_SUCCESS ? "rebuilt" : "failed to rebuild", shell,
+          (double)(finished.tv_sec - started.tv_sec) * 1e3 +
+          (double)(finished.tv_nsec - started.tv_nsec) / 1e6);
+  return rc;
+}
+
+/**
+ * Watches the base directory and whichever sub-directories exist. wds
+ * holds the base first, then shared/, zsh/ and bash/ (-1 when missing).
+ * Adding a path that is already watched returns its existing descriptor.
+ */
+static int watch_add_dirs(int fd, const char *scripts_dir, int wds[4]) {
+  static const char *subs[3] = { SUB_SHARED, SUB_ZSH, SUB_BASH };
+  char path[PATH_MAX];
+
+  wds[0] = inotify_add_watch(fd, scripts_dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                              IN_MOVED_TO | IN_ONLYDIR);
+  if (wds[0] < 0) {
+    fprintf(stderr, "scriptsort: cannot watch '%s': %s\n", scripts_dir, strerror(errno));
+    return -1;
+  }
+  for (int i = 0; i < 3; i++) {
+    snprintf(path, sizeof(path), "%s/%s", scripts_dir, subs[i]);
+    wds[i + 1] = inotify_add_watch(fd, path, IN_CREATE | IN_DELETE | IN_MODIFY |
+                                             IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+                                             IN_ATTRIB | IN_ONLYDIR);
+  }
+  return 0;
+}
+
+/* Whether name is one of the sub-directories a bundle is built from. */
+static Boolean watch_is_subdir(const char *name) {
+  return strcmp(name, SUB_SHARED) == 0 || strcmp(name, SUB_ZSH) == 0 ||
+         strcmp(name, SUB_BASH) == 0;
+}
+
+/**
+ * Reads one batch of inotify events and adds the variants they affect to
+ * *pending: shared/ affects every shell, a shell sub-directory only its
+ * own, and the base directory everything, after re-watching. In the base
+ * directory only shared, zsh and bash coming or going count; editor swap
+ * files and other entries there are ignored. Returns -1 if the event
+ * stream or the base directory's watch is lost.
+ */
+static int watch_read_events(int fd, const char *scripts_dir, int wds[4],
+                             const char **shells, int shell_count, unsigned *pending) {
+  char     events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  unsigned all     = (1u << shell_count) - 1;
+  Boolean  rewatch = Falsehood;
+
+  ssize_t len = read(fd, events, sizeof(events));
+  if (len <= 0) {
+    if (len < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+    fprintf(stderr, "scriptsort: lost the inotify stream: %s\n", strerror(errno));
+    return -1;
+  }
+
+  for (char *p = events; p < events + len; ) {
+    const struct inotify_event *ev = (const struct inotify_event *)p;
+    p += sizeof(*ev) + ev->len;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+      *pending |= all;
+    } else if (ev->wd == wds[0]) {
+      if (ev->len > 0 && !watch_is_subdir(ev->name)) continue;
+      rewatch   = Truth;
+      *pending |= all;
+    } else if (ev->wd == wds[1]) {
+      *pending |= all;
+      if (ev->mask & IN_IGNORED) rewatch = Truth;
+    } else {
+      const char *shell = (ev->wd == wds[2]) ? SUB_ZSH : (ev->wd == wds[3]) ? SUB_BASH : NULL;
+      for (int v = 0; shell && v < shell_count; v++)
+        if (strcmp(shells[v], shell) == 0) *pending |= 1u << v;
+      if (ev->mask & IN_IGNORED) rewatch = Truth;
+    }
+  }
+  return rewatch ? watch_add_dirs(fd, scripts_dir, wds) : 0;
+}
+
+#endif /* __linux__ */
+
+static int watch_main(int argc, char **argv) {
+  const char  *scripts_dir    = NULL;
+  const char  *shell_override = NULL;
+  const char  *output_path    = NULL;
+  Boolean      debugtext      = Falsehood;
+  unsigned int cutoff_count   = 50;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      print_subcommand_help("scriptsort", find_subcommand("watch"));
+      return EXIT_SUCCESS;
+    } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--scripts-dir") == 0) && i + 1 < argc) {
+      scripts_dir = argv[++i];
+    } else if (strcmp(argv[i], "--zsh") == 0) {
+      shell_override = SUB_ZSH;
+    } else if (strcmp(argv[i], "--bash") == 0) {
+      shell_override = SUB_BASH;
+    } else if ((strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (strcmp(argv[i], "--debug") == 0) {
+      debugtext = Truth;
+    } else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n <= 0) {
+        fprintf(stderr, SGR_RED "--cutoff requires a number greater than 0\n" SGR_RESET);
+        return EXIT_FAILURE;
+      }
+      cutoff_count = (unsigned int)n;
+    } else {
+      fprintf(stderr, SGR_RED "Unknown argument: %s\n" SGR_RESET, argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!scripts_dir) {
+    print_subcommand_help("scriptsort", find_subcommand("watch"));
+    return EXIT_FAILURE;
+  }
+
+  /* Absolute, as bundle_key() makes it, so a later cd changes nothing */
+  char absolute[PATH_MAX];
+  if (absolute_path(scripts_dir, absolute, sizeof(absolute)) == 0) scripts_dir = absolute;
+
+  /* One variant per shell; a single one when the shell is given */
+  const char *shells[2]  = { SUB_ZSH, SUB_BASH };
+  int         shell_count = 2;
+  char        outputs[2][PATH_MAX];
+
+  if (shell_override) {
+    shells[0]   = shell_override;
+    shell_count = 1;
+  }
+  const char *slot = output_path ? strstr(output_path, "{shell}") : NULL;
+  if (output_path && shell_count > 1 && !slot) {
+    fprintf(stderr, SGR_RED "--output needs a {shell} placeholder unless --zsh or --bash is given\n" SGR_RESET);
+    return EXIT_FAILURE;
+  }
+  for (int v = 0; v < shell_count && output_path; v++) {
+    int len = slot ? (int)(slot - output_path) : (int)strlen(output_path);
+    if (snprintf(outputs[v], sizeof(outputs[v]), "%.*s%s%s", len, output_path,
+                 slot ? shells[v] : "", slot ? slot + strlen("{shell}") : "") >= (int)sizeof(outputs[v])) {
+      fprintf(stderr, SGR_RED "--output path too long\n" SGR_RESET);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* Writing the output into a watched directory would trigger the next rebuild */
+  for (int v = 0; v < shell_count && output_path; v++) {
+    char parent[PATH_MAX];
+    char real_parent[PATH_MAX];
+    char watched[PATH_MAX];
+    char real_watched[PATH_MAX];
+
+    memcpy(parent, outputs[v], sizeof(parent));
+    char *sep = strrchr(parent, '/');
+    if (sep) *sep = '\0';
+    if (!realpath(sep ? (parent[0] ? parent : "/") : ".", real_parent)) continue;
+
+    for (int d = 0; d < 4; d++) {
+      static const char *subs[4] = { "", "/" SUB_SHARED, "/" SUB_ZSH, "/" SUB_BASH };
+      snprintf(watched, sizeof(watched), "%s%s", scripts_dir, subs[d]);
+      if (realpath(watched, real_watched) && strcmp(real_watched, real_parent) == 0) {
+        fprintf(stderr, SGR_RED "--output must not be inside '%s', which is watched\n" SGR_RESET,
+                watched);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+#ifdef __linux__
+  int wds[4];
+  int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  int fd      = inotify_init1(IN_CLOEXEC);
+  if (fd < 0 || null_fd < 0) {
+    fprintf(stderr, "scriptsort: cannot start watching: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (watch_add_dirs(fd, scripts_dir, wds) != 0) return EXIT_FAILURE;
+
+  unsigned pending = (1u << shell_count) - 1;
+
+  for (;;) {
+    for (int v = 0; v < shell_count; v++) {
+      if (pending & (1u << v))
+        watch_rebuild(scripts_dir, shells[v], output_path ? outputs[v] : NULL,
+                      cutoff_count, debugtext, null_fd);
+    }
+    pending = 0;
+
+    /* Block for the first event, then gather until the burst settles */
+    struct pollfd pfd  = { fd, POLLIN, 0 };
+    int           wait = -1;
+    while (poll(&pfd, 1, wait) > 0) {
+      if (watch_read_events(fd, scripts_dir, wds, shells, shell_count, &pending) != 0)
+        return EXIT_FAILURE;
+      wait = WATCH_DEBOUNCE_MS;
+    }
+  }
+#else
+  (void)debugtext;
+  (void)outputs;
+  fprintf(stderr, "scriptsort: watch needs inotify, which this platform does not have\n");
+  return EXIT_FAILURE;
+#endif
+}
+
+/* =========================================================================
+ * serve subcommand and its client
+ *
+ * A resident daemon holds each shell's finished bundle in memory and
+ * listens on one Unix socket per variant, named by the same key as the
+ * variant's cache entry. A connection is answered with a single write of
+ * a prebuilt buffer (an 8-byte length, then the bundle) and closed; no
+ * directory is walked and no script is read on that path. inotify keeps
+ * the buffers current, exactly as for watch. bundle -s asks the socket
+ * first and generates in-process when nothing answers.
+ * ====================================================================== */
+
+/**
+ * Fills path with the socket for spec's variant:
+ * ${XDG_RUNTIME_DIR}/scriptsort/<key>.sock, or beside the cache entries
+ * when there is no runtime directory. Returns -1 when there is no such
+ * place or the path does not fit a socket address.
+ */
+static int daemon_socket_path(const BundleSpec *spec, char *path, size_t size) {
+  const char        *runtime = getenv("XDG_RUNTIME_DIR");
+  char               dir[PATH_MAX];
+  char               abs[PATH_MAX];
+  uint64_t           key;
+  struct sockaddr_un addr;
+
+  if (runtime && runtime[0] == '/') snprintf(dir, sizeof(dir), "%s/scriptsort", runtime);
+  else if (cache_base_dir(dir, sizeof(dir)) != 0) return -1;
+  if (bundle_key(spec, abs, &key) != 0) return -1;
+
+  int n = snprintf(path, size, "%s/%016llx.sock", dir, (unsigned long long)key);
+  return (n < 0 || (size_t)n >= size || (size_t)n >= sizeof(addr.sun_path)) ? -1 : 0;
+}
+
+/* Connects to the socket at path. Returns the fd, or -1. */
+static int daemon_connect(const char *path) {
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Asks a serve daemon for spec's bundle and queues it on out. Returns 0
+ * when served, 1 when no daemon answered completely (nothing was queued)
+ * and -1 if writing the bundle failed.
+ */
+static int daemon_fetch(const BundleSpec *spec, Emitter *out, LoadStats *stats) {
+  char           path[PATH_MAX];
+  uint64_t       len  = 0;
+  size_t         got  = 0;
+  char          *body = NULL;
+  struct timeval limit = { DAEMON_TIMEOUT_S, 0 };
+
+  if (daemon_socket_path(spec, path, sizeof(path)) != 0) return 1;
+  int fd = daemon_connect(path);
+  stats->syscalls += 2;
+  if (fd < 0) return 1;
+
+  /* A wedged daemon must not hold up shell startup for long */
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+  while (got < sizeof(len) + len) {
+    char   *to   = got < sizeof(len) ? (char *)&len + got : body + (got - sizeof(len));
+    size_t  want = got < sizeof(len) ? sizeof(len) - got : sizeof(len) + len - got;
+    ssize_t n    = read(fd, to, want);
+    stats->syscalls++;
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got += (size_t)n;
+
+    if (got == sizeof(len) && !body) {
+      body = (len > 0 && len < SIZE_MAX) ? malloc((size_t)len) : NULL;
+      if (!body) break;
+    }
+  }
+  close(fd);
+
+  if (!body || got != sizeof(len) + len) {
+    free(body);
+    return 1;
+  }
+  stats->bytes = (size_t)len;
+  if (emit_owned(out, body, (size_t)len) != 0) return -1;
+  return emit_flush(out) == 0 ? 0 : -1;
+}
+
+#ifdef __linux__
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_on_signal(int sig) {
+  (void)sig;
+  serve_stop = 1;
+}
+
+/**
+ * Generates the variant's bundle into a memfd and copies it, behind its
+ * length, into the buffer connections are answered from. The previous
+ * buffer stays in service if generation fails. Returns 0 or -1.
+ */
+static int serve_build(ServeVariant *v) {
+  BundleSource sources[2];
+  LoadOptions  load = { 1, ENGINE_SYNC, Falsehood };
+  LoadStats    stats;
+  Emitter      em;
+  struct stat  st;
+  char        *reply = NULL;
+
+  memset(&stats, 0, sizeof(stats));
+  int fd = memfd_create("scriptsort-bundle", MFD_CLOEXEC);
+  if (fd < 0) return -1;
+
+  int count = plan_bundle_sources(&v->spec, sources);
+  emit_init(&em, fd);
+  int rc = bundle_generate(&em, &v->spec, sources, &count, &load, &stats, NULL);
+  free_bundle_sources(sources, count);
+
+  if (rc == 0 && fstat(fd, &st) == 0) {
+    uint64_t len = (uint64_t)st.st_size;
+    size_t   got = 0;
+
+    reply = malloc(sizeof(len) + (size_t)len);
+    if (reply) {
+      memcpy(reply, &len, sizeof(len));
+      while (got < (size_t)len) {
+        ssize_t n = pread(fd, reply + sizeof(len) + got, (size_t)len - got, (off_t)got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+      }
+      if (got != (size_t)len) {
+        free(reply);
+        reply = NULL;
+      } else {
+        free(v->reply);
+        v->reply      = reply;
+        v->reply_size = sizeof(len) + (size_t)len;
+      }
+    }
+  }
+  close(fd);
+  return reply ? 0 : -1;
+}
+
+/* Answers one pending connection on the variant's socket. */
+static void serve_answer(const ServeVariant *v) {
+  struct timeval limit = { DAEMON_TIMEOUT_S, 0 };
+  size_t         sent  = 0;
+
+  int fd = accept4(v->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0) return;
+
+  /* One write in practice; a reader that stalls is cut off, not waited on */
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+  while (v->reply && sent < v->reply_size) {
+    ssize_t n = write(fd, v->reply + sent, v->reply_size - sent);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    sent += (size_t)n;
+  }
+  close(fd);
+}
+
+/**
+ * Binds the variant's socket, refusing to take over one a live daemon
+ * still answers on. Only the owner may connect. Returns 0 or -1.
+ */
+static int serve_listen(ServeVariant *v) {
+  struct sockaddr_un addr;
+  char               dir[PATH_MAX];
+
+  snprintf(dir, sizeof(dir), "%s", v->socket_path);
+  *strrchr(dir, '/') = '\0';
+  if (make_dirs(dir) != 0) {
+    fprintf(stderr, "scriptsort: cannot create '%s': %s\n", dir, strerror(errno));
+    return -1;
+  }
+
+  int live = daemon_connect(v->socket_path);
+  if (live >= 0) {
+    close(live);
+    fprintf(stderr, "scriptsort: a daemon already serves the %s bundle on '%s'\n",
+            v->spec.shell_subdir, v->socket_path);
+    return -1;
+  }
+  unlink(v->socket_path);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", v->socket_path);
+
+  v->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  mode_t mask  = umask(077);
+  int    rc    = (v->listen_fd >= 0 &&
+                  bind(v->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+                  listen(v->listen_fd, SOMAXCONN) == 0) ? 0 : -1;
+  umask(mask);
+  if (rc != 0) fprintf(stderr, "scriptsort: cannot listen on '%s': %s\n", v->socket_path, strerror(errno));
+  return rc;
+}
+
+#endif /* __linux__ */
+
+static int serve_main(int argc, char **argv) {
+  const char  *scripts_dir    = NULL;
+  const char  *shell_override = NULL;
+  Boolean      debugtext      = Falsehood;
+  unsigned int cutoff_count   = 50;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      print_subcommand_help("scriptsort", find_subcommand("serve"));
+      return EXIT_SUCCESS;
+    } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--scripts-dir") == 0) && i + 1 < argc) {
+      scripts_dir = argv[++i];
+    } else if (strcmp(argv[i], "--zsh") == 0) {
+      shell_override = SUB_ZSH;
+    } else if (strcmp(argv[i], "--bash") == 0) {
+      shell_override = SUB_BASH;
+    } else if (strcmp(argv[i], "--debug") == 0) {
+      debugtext = Truth;
+    } else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n <= 0) {
+        fprintf(stderr, SGR_RED "--cutoff requires a number greater than 0\n" SGR_RESET);
+        return EXIT_FAILURE;
+      }
+      cutoff_count = (unsigned int)n;
+    } else {
+      fprintf(stderr, SGR_RED "Unknown argument: %s\n" SGR_RESET, argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!scripts_dir) {
+    print_subcommand_help("scriptsort", find_subcommand("serve"));
+    return EXIT_FAILURE;
+  }
+
+  /* Absolute, as bundle_key() makes it, so a later cd changes nothing */
+  char absolute[PATH_MAX];
+  if (absolute_path(scripts_dir, absolute, sizeof(absolute)) == 0) scripts_dir = absolute;
+
+#ifdef __linux__
+  const char  *shells[2]   = { SUB_ZSH, SUB_BASH };
+  int          shell_count = 2;
+  ServeVariant variants[2];
+  int          wds[4];
+  int          status      = EXIT_FAILURE;
+
+  if (shell_override) {
+    shells[0]   = shell_override;
+    shell_count = 1;
+  }
+
+  memset(variants, 0, sizeof(variants));
+  for (int v = 0; v < shell_count; v++) {
+    BundleSpec spec = { NULL, scripts_dir, shells[v], cutoff_count, debugtext };
+    variants[v].spec      = spec;
+    variants[v].listen_fd = -1;
+  }
+
+  int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (fd < 0 || watch_add_dirs(fd, scripts_dir, wds) != 0) return EXIT_FAILURE;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = serve_on_signal;
+  sigaction(SIGINT,  &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int v = 0; v < shell_count; v++) {
+    if (daemon_socket_path(&variants[v].spec, variants[v].socket_path,
+                           sizeof(variants[v].socket_path)) != 0) {
+      fprintf(stderr, "scriptsort: no usable socket path for '%s'\n", scripts_dir);
+      goto done;
+    }
+    if (serve_listen(&variants[v]) != 0) goto done;
+    if (serve_build(&variants[v]) != 0)
+      fprintf(stderr, "scriptsort: cannot build the %s bundle; not answering for it yet\n", shells[v]);
+    fprintf(stderr, "scriptsort: serving %s bundle on %s\n", shells[v], variants[v].socket_path);
+  }
+
+  unsigned pending = 0;
+  int64_t  due_ms  = 0;
+  while (!serve_stop) {
+    struct pollfd   pfds[3];
+    struct timespec now;
+    int             timeout = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t now_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    if (pending && now_ms >= due_ms) {
+      for (int v = 0; v < shell_count; v++) {
+        if ((pending & (1u << v)) && serve_build(&variants[v]) != 0)
+          fprintf(stderr, "scriptsort: cannot rebuild the %s bundle; serving the previous one\n", shells[v]);
+      }
+      pending = 0;
+    }
+    if (pending) timeout = (int)(due_ms - now_ms);
+
+    pfds[0].fd     = fd;
+    pfds[0].events = POLLIN;
+    for (int v = 0; v < shell_count; v++) {
+      pfds[v + 1].fd     = variants[v].listen_fd;
+      pfds[v + 1].events = POLLIN;
+    }
+    if (poll(pfds, (nfds_t)(shell_count + 1), timeout) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "scriptsort: poll failed: %s\n", strerror(errno));
+      goto done;
+    }
+
+    /* Until a burst of edits settles, requests get the previous bundle */
+    for (int v = 0; v < shell_count; v++)
+      if (pfds[v + 1].revents & POLLIN) serve_answer(&variants[v]);
+    if (pfds[0].revents & POLLIN) {
+      if (watch_read_events(fd, scripts_dir, wds, shells, shell_count, &pending) != 0) goto done;
+      if (pending) due_ms = now_ms + WATCH_DEBOUNCE_MS;
+    }
+  }
+  status = EXIT_SUCCESS;
+
+done:
+  for (int v = 0; v < shell_count; v++) {
+    if (variants[v].listen_fd >= 0) {
+      close(variants[v].listen_fd);
+      unlink(variants[v].socket_path);
+    }
+    free(variants[v].reply);
+  }
+  close(fd);
+  return status;
+#else
+  (void)shell_override;
+  (void)debugtext;
+  (void)cutoff_count;
+  fprintf(stderr, "scriptsort: serve needs inotify, which this platform does not have\n");
+  return EXIT_FAILURE;
+#endif
+}
+
+/* =========================================================================
+ * profile subcommand
+ *
+ * Sources the bundle in a fresh non-interactive shell with xtrace on and a
+ * PS4 that stamps every traced command with $EPOCHREALTIME and the file and
+ * line it came from. A command is charged the time until the next one
+ * starts. Bundle lines are mapped back to script lines through the ranges
+ * in the bundle's own file headers. Afterwards the same shell reports what
+ * each command word resolved to, so external commands can be counted with
+ * the functions and aliases the bundle defined in place.
+ * ====================================================================== */
+
+/*
+ * Run as `<shell> -c <script> scriptsort-profile <bundle> <trace>`. The
+ * trace is closed before "ready"; then each word read from stdin gets one
+ * line back naming its type, empty or "none" when nothing matches.
+ */
+static const char PROFILE_BASH[] =
+  "exec 9>\"$2\"\n"
+  "BASH_XTRACEFD=9\n"
+  "PS4=$'+\\x1f${EPOCHREALTIME}\\x1f${BASH_SOURCE-}\\x1f${LINENO}\\x1f${FUNCNAME[@]-}\\x1f'\n"
+  "set -x\n"
+  "source \"$1\" </dev/null >&2\n"
+  "set +x\n"
+  "unset BASH_XTRACEFD\n"
+  "printf 'ready\\n'\n"
+  "while IFS= read -r word; do\n"
+  "  type -t -- \"$word\" || printf '\\n'\n"
+  "done\n";
+
+/* zsh traces to stderr, which is pointed at the trace while sourcing */
+static const char PROFILE_ZSH[] =
+  "zmodload zsh/datetime\n"
+  "setopt prompt_subst\n"
+  "PS4=$'+\\x1f${EPOCHREALTIME}\\x1f%x\\x1f%I\\x1f${funcstack[@]-}\\x1f'\n"
+  "exec 9>&2 2>\"$2\"\n"
+  "set -x\n"
+  "source \"$1\" </dev/null >&9\n"
+  "set +x\n"
+  "exec 2>&9 9>&-\n"
+  "print ready\n"
+  "while IFS= read -r word; do\n"
+  "  whence -w -- \"$word\"\n"
+  "done\n";
+
+/* $0 of the profiling shell. Its own commands carry no file path */
+#define PROFILE_ARGV0 "scriptsort-profile"
+
+/**
+ * Reads the file ranges back out of the bundle's headers: a
+ * "# --- <dir>/<file> (lines a-b) ---" comment is taken only when the two
+ * header lines follow it and a is the line after them, so a script's own
+ * comments cannot pose as one. Also indexes where every bundle line
+ * starts. Returns 0 or -1.
+ */
+static int profile_read_bundle(const char *text, size_t size, ProfileReport *r) {
+  size_t line_cap = 1024;
+  size_t file_cap = 64;
+
+  r->line_starts = malloc(line_cap * sizeof(size_t));
+  r->files       = malloc(file_cap * sizeof(ProfileFile));
+  if (!r->line_starts || !r->files) return -1;
+
+  /* Index 0 collects the wrapper's own lines */
+  memset(&r->files[0], 0, sizeof(ProfileFile));
+  r->files[0].path = strdup("(wrapper)");
+  r->file_count    = 1;
+  if (!r->files[0].path) return -1;
+
+  r->line_starts[r->line_count++] = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (text[i] != '\n' || i + 1 == size) continue;
+    if (r->line_count == line_cap) {
+      size_t *grown = realloc(r->line_starts, (line_cap *= 2) * sizeof(size_t));
+      if (!grown) return -1;
+      r->line_starts = grown;
+    }
+    r->line_starts[r->line_count++] = i + 1;
+  }
+
+  for (size_t n = 0; n + 2 < r->line_count; n++) {
+    const char *line = text + r->line_starts[n];
+    const char *end  = text + (n + 1 < r->line_count ? r->line_starts[n + 1] - 1 : size);
+    const char *mark = NULL;
+    int         first;
+    int         last;
+
+    if ((size_t)(end - line) < 6 || memcmp(line, "# --- ", 6) != 0) continue;
+    for (const char *p = line; p + 8 <= end; p++)
+      if (memcmp(p, " (lines ", 8) == 0) mark = p;
+    if (!mark || sscanf(mark, " (lines %d-%d) ---", &first, &last) != 2) continue;
+    if ((size_t)first != n + 4 ||
+        strncmp(text + r->line_starts[n + 1], "_SCRIPTSORT_FILE=", 17) != 0) continue;
+
+    if (r->file_count == file_cap) {
+      ProfileFile *grown = realloc(r->files, (file_cap *= 2) * sizeof(ProfileFile));
+      if (!grown) return -1;
+      r->files = grown;
+    }
+    ProfileFile *f = &r->files[r->file_count];
+    memset(f, 0, sizeof(*f));
+    f->path  = strndup(line + 6, (size_t)(mark - line - 6));
+    f->first = first;
+    f->last  = last;
+    if (!f->path) return -1;
+    r->file_count++;
+  }
+  r->bundled = r->file_count;
+  return 0;
+}
+
+/* Index of the file named path, added as a file outside the bundle if new. */
+static int profile_file_index(ProfileReport *r, const char *path, size_t len) {
+  for (size_t i = r->bundled; i < r->file_count; i++)
+    if (strlen(r->files[i].path) == len && memcmp(r->files[i].path, path, len) == 0)
+      return (int)i;
+
+  ProfileFile *grown = realloc(r->files, (r->file_count + 1) * sizeof(ProfileFile));
+  if (!grown) return -1;
+  r->files = grown;
+  ProfileFile *f = &r->files[r->file_count];
+  memset(f, 0, sizeof(*f));
+  f->path = strndup(path, len);
+  if (!f->path) return -1;
+  return (int)r->file_count++;
+}
+
+/**
+ * Copies the first word of a traced command into word, skipping leading
+ * NAME=value assignments and undoing xtrace's '...', $'...' and "..."
+ * quoting. Returns 0, or -1 when the command has no such word.
+ */
+static int profile_first_word(const char *p, const char *end, char *word, size_t size) {
+  while (p < end) {
+    size_t len   = 0;
+    char   quote = 0;
+
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p == end) return -1;
+
+    for (; p < end; p++) {
+      char c = *p;
+      if (quote == '\'') {
+        if (c == '\'') { quote = 0; continue; }
+      } else if (quote) {
+        if (c == quote) { quote = 0; continue; }
+        if (c == '\\' && p + 1 < end) c = *++p;
+      } else if (c == ' ' || c == '\t') {
+        break;
+      } else if (c == '\'' || c == '"') {
+        quote = c;
+        continue;
+      } else if (c == '$' && p + 1 < end && p[1] == '\'') {
+        quote = '$';
+        p++;
+        continue;
+      } else if (c == '\\' && p + 1 < end) {
+        c = *++p;
+      }
+      if (quote == '$' && c == '\'') { quote = 0; continue; }
+      if (len + 1 < size) word[len++] = c;
+    }
+    word[len] = '\0';
+
+    /* An assignment is no command; the next word may be */
+    size_t name = 0;
+    while (name < len && (isalnum((unsigned char)word[name]) || word[name] == '_')) name++;
+    Boolean assignment = (name > 0 && !isdigit((unsigned char)word[0]) && name < len &&
+                          (word[name] == '=' || word[name] == '[' ||
+                           (word[name] == '+' && name + 1 < len && word[name + 1] == '=')));
+    if (!assignment) return len > 0 ? 0 : -1;
+  }
+  return -1;
+}
+
+/**
+ * Turns the shell's function stack (innermost first, space separated) into
+ * folded-stack frames, outermost first: "function a;function b". bash's
+ * "source" and "main" entries and zsh's sourced file paths are not calls
+ * and are left out. Returns NULL at the top level of a file.
+ */
+static char *profile_frames(const char *p, const char *end) {
+  const char *names[64];
+  size_t      lens[64];
+  size_t      count = 0;
+  size_t      total = 0;
+
+  while (p < end && count < 64) {
+    const char *name = p;
+    while (p < end && *p != ' ') p++;
+    size_t len = (size_t)(p - name);
+    if (len > 0 && memchr(name, '/', len) == NULL &&
+        !(len == 6 && memcmp(name, "source", 6) == 0) &&
+        !(len == 4 && memcmp(name, "main", 4) == 0) &&
+        !(len == sizeof(PROFILE_ARGV0) - 1 && memcmp(name, PROFILE_ARGV0, len) == 0)) {
+      names[count] = name;
+      lens[count++] = len;
+      total += len + sizeof("function ;") - 1;
+    }
+    if (p < end) p++;
+  }
+  if (count == 0) return NULL;
+
+  char *frames = malloc(total);
+  char *out    = frames;
+  if (!frames) return NULL;
+  for (size_t i = count; i-- > 0; ) {
+    out += sprintf(out, "function %.*s", (int)lens[i], names[i]);
+    if (i > 0) *out++ = ';';
+  }
+  return frames;
+}
+
+/* Parses an $EPOCHREALTIME stamp (either radix character) into microseconds. */
+static int64_t profile_stamp_us(const char *p, const char *end) {
+  int64_t seconds = 0;
+  int64_t micros  = 0;
+  int     digits  = 0;
+
+  for (; p < end && isdigit((unsigned char)*p); p++) seconds = seconds * 10 + (*p - '0');
+  if (p < end && (*p == '.' || *p == ',')) p++;
+  for (; p < end && isdigit((unsigned char)*p); p++)
+    if (digits < 6) { micros = micros * 10 + (*p - '0'); digits++; }
+  for (; digits < 6; digits++) micros *= 10;
+  return seconds * 1000000 + micros;
+}
+
+/**
+ * Turns the trace into one hit per traced command: its file, line, first
+ * word and the time until the next command began. Lines that do not start
+ * with a PS4 stamp continue a multi-line command (or are zsh's stderr) and
+ * are skipped. Returns 0, or -1 when no command carried a usable stamp.
+ */
+static int profile_read_trace(const char *text, size_t size, const char *bundle_path,
+                              ProfileReport *r) {
+  size_t      cap         = 4096;
+  size_t      bundle_len  = strlen(bundle_path);
+  const char *end_of_text = text + size;
+
+  r->hits = malloc(cap * sizeof(ProfileHit));
+  if (!r->hits) return -1;
+
+  for (const char *line = text; line < end_of_text; ) {
+    const char *end = memchr(line, '\n', (size_t)(end_of_text - line));
+    if (!end) end = end_of_text;
+    const char *field[5];
+    const char *p = line;
+    int         n = 0;
+
+    while (p < end && *p == '+') p++;
+    if (p > line && p < end && *p == '\x1f') {
+      for (p++; n < 5 && p <= end; n++) {
+        field[n] = p;
+        while (p < end && *p != '\x1f') p++;
+        p++;
+      }
+    }
+    if (n == 5 && p <= end + 1 && field[0][0] != '\x1f') {
+      if (r->hit_count == cap) {
+        ProfileHit *grown = realloc(r->hits, (cap *= 2) * sizeof(ProfileHit));
+        if (!grown) return -1;
+        r->hits = grown;
+      }
+      ProfileHit *h     = &r->hits[r->hit_count++];
+      size_t      src   = (size_t)(field[2] - field[1] - 1);
+      char        word[MAX_FILENAME];
+
+      memset(h, 0, sizeof(*h));
+      h->at   = profile_stamp_us(field[0], field[1] - 1);
+      h->line = atoi(field[2]);
+      h->file = -1;
+      h->bundle_line = h->line;
+      if (src == bundle_len && memcmp(field[1], bundle_path, src) == 0) {
+        h->file = 0;
+        for (size_t f = 1; f < r->bundled; f++) {
+          if (h->line >= r->files[f].first && h->line <= r->files[f].last) {
+            h->line        = h->line - r->files[f].first + 1;
+            h->file        = (int)f;
+            break;
+          }
+        }
+      } else if (memchr(field[1], '/', src)) {
+        h->file        = profile_file_index(r, field[1], src);
+        h->bundle_line = 0;
+      }
+      if (field[4] < end && profile_first_word(field[4], end, word, sizeof(word)) == 0)
+        h->word = strdup(word);
+      h->frames = profile_frames(field[3], field[4] - 1);
+    }
+    line = end + 1;
+  }
+
+  /* Each command runs until the next one is stamped */
+  for (size_t i = 0; i + 1 < r->hit_count; i++) {
+    int64_t us = r->hits[i + 1].at - r->hits[i].at;
+    r->hits[i].us = us > 0 ? us : 0;
+  }
+  return r->hit_count > 1 && r->hits[0].at > 0 ? 0 : -1;
+}
+
+static int compare_words(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Sends every distinct command word to the shell, one line at a time, and
+ * marks the hits whose word resolved to a file on disk. The exchange is in
+ * lockstep, so neither pipe can fill.
+ */
+static void profile_classify(ProfileReport *r, int to_shell, FILE *from_shell) {
+  char  **words = malloc((r->hit_count ? r->hit_count : 1) * sizeof(char *));
+  size_t  count = 0;
+  char    answer[256];
+
+  if (!words) return;
+  for (size_t i = 0; i < r->hit_count; i++)
+    if (r->hits[i].word && r->hits[i].file >= 0) words[count++] = r->hits[i].word;
+  qsort(words, count, sizeof(char *), compare_words);
+
+  size_t unique = 0;
+  for (size_t i = 0; i < count; i++)
+    if (unique == 0 || strcmp(words[unique - 1], words[i]) != 0) words[unique++] = words[i];
+
+  Boolean *external = calloc(unique ? unique : 1, sizeof(Boolean));
+  for (size_t i = 0; external && i < unique; i++) {
+    size_t len = strlen(words[i]);
+    if (write(to_shell, words[i], len) != (ssize_t)len || write(to_shell, "\n", 1) != 1 ||
+        !fgets(answer, sizeof(answer), from_shell)) break;
+
+    /* bash: "file"; zsh: "<word>: command" or "<word>: hashed" */
+    const char *kind = strrchr(answer, ' ');
+    kind = kind ? kind + 1 : answer;
+    external[i] = (strcmp(kind, "file\n") == 0 || strcmp(kind, "command\n") == 0 ||
+                   strcmp(kind, "hashed\n") == 0);
+  }
+
+  for (size_t i = 0; external && i < r->hit_count; i++) {
+    ProfileHit *h = &r->hits[i];
+    if (!h->word || h->file < 0) continue;
+    char **found = bsearch(&h->word, words, unique, sizeof(char *), compare_words);
+    h->external = found && external[found - words];
+  }
+  free(external);
+  free(words);
+}
+
+static int compare_hits_by_line(const void *a, const void *b) {
+  const ProfileHit *x = (const ProfileHit *)a;
+  const ProfileHit *y = (const ProfileHit *)b;
+  if (x->file != y->file) return x->file < y->file ? -1 : 1;
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static int compare_hits_by_cost(const void *a, const void *b) {
+  const ProfileHit *x = (const ProfileHit *)a;
+  const ProfileHit *y = (const ProfileHit *)b;
+  return x->us < y->us ? 1 : x->us > y->us ? -1 : 0;
+}
+
+static int compare_files_by_cost(const void *a, const void *b) {
+  const ProfileFile *x = *(const ProfileFile *const *)a;
+  const ProfileFile *y = *(const ProfileFile *const *)b;
+  return x->us < y->us ? 1 : x->us > y->us ? -1 : 0;
+}
+
+/**
+ * Prints the per-file table and the top hot lines. Hits are summed into
+ * their files, then folded into one entry per line in place (the hit
+ * count of a line goes into its at field).
+ */
+static void profile_print(ProfileReport *r, const char *text, const char *shell, unsigned top) {
+  int64_t total = 0;
+  size_t  lines = 0;
+
+  for (size_t i = 0; i < r->hit_count; i++) {
+    ProfileHit *h = &r->hits[i];
+    if (h->file < 0) continue;
+    r->files[h->file].us += h->us;
+    r->files[h->file].commands++;
+    r->files[h->file].external += h->external ? 1 : 0;
+    total += h->us;
+  }
+
+  ProfileFile **order = malloc(r->file_count * sizeof(ProfileFile *));
+  if (!order) return;
+  for (size_t i = 0; i < r->file_count; i++) order[i] = &r->files[i];
+  qsort(order, r->file_count, sizeof(ProfileFile *), compare_files_by_cost);
+
+  printf("scriptsort profile: %zu files under %s, %.3f ms over %zu commands\n"
+         "xtrace slows every command alike; compare the costs, not the total\n\n",
+         r->bundled - 1, shell, (double)total / 1e3, r->hit_count);
+  printf("%10s %7s %8s %5s  %s\n", "ms", "share", "commands", "ext", "file");
+  for (size_t i = 0; i < r->file_count; i++) {
+    const ProfileFile *f = order[i];
+    if (f->commands == 0) continue;
+    printf("%10.3f %6.1f%% %8zu %5zu  %s\n", (double)f->us / 1e3,
+           total > 0 ? 100.0 * (double)f->us / (double)total : 0.0,
+           f->commands, f->external, f->path);
+  }
+  free(order);
+
+  /* Words are done with; folding would otherwise lose track of them */
+  for (size_t i = 0; i < r->hit_count; i++) {
+    free(r->hits[i].word);
+    free(r->hits[i].frames);
+    r->hits[i].word   = NULL;
+    r->hits[i].frames = NULL;
+  }
+  qsort(r->hits, r->hit_count, sizeof(ProfileHit), compare_hits_by_line);
+  for (size_t i = 0; i < r->hit_count; i++) {
+    ProfileHit *h = &r->hits[i];
+    if (h->file < 0) continue;
+    if (lines > 0 && r->hits[lines - 1].file == h->file && r->hits[lines - 1].line == h->line) {
+      r->hits[lines - 1].us += h->us;
+      r->hits[lines - 1].at++;
+    } else {
+      ProfileHit folded = *h;
+      folded.at = 1;
+      r->hits[lines++] = folded;
+    }
+  }
+  qsort(r->hits, lines, sizeof(ProfileHit), compare_hits_by_cost);
+
+  printf("\n%10s %7s  %s\n", "ms", "hits", "hot line");
+  for (size_t i = 0; i < lines && i < top; i++) {
+    const ProfileHit *h = &r->hits[i];
+    printf("%10.3f %7lld  %s:%d", (double)h->us / 1e3, (long long)h->at,
+           r->files[h->file].path, h->line);
+    if (h->bundle_line > 0 && (size_t)h->bundle_line <= r->line_count) {
+      const char *src = text + r->line_starts[h->bundle_line - 1];
+      int         len = 0;
+      while (*src == ' ' || *src == '\t') src++;
+      while (src[len] && src[len] != '\n' && len < 60) len++;
+      printf("  %.*s", len, src);
+    }
+    putchar('\n');
+  }
+}
+
+typedef struct {
+  char    *stack;
+  int64_t  us;
+} FoldedStack;
+
+static int compare_folded(const void *a, const void *b) {
+  return strcmp(((const FoldedStack *)a)->stack, ((const FoldedStack *)b)->stack);
+}
+
+/**
+ * Prints the hits as folded stacks, "bundle;<file>[;function f...] <us>",
+ * one line per distinct stack, for flamegraph.pl and compatible tools. A
+ * function is placed under the bundled file whose top-level command called
+ * it, wherever it was defined; commands at the top of a file sourced from
+ * outside the bundle sit under "source <path>".
+ */
+static int profile_print_folded(const ProfileReport *r) {
+  FoldedStack *stacks  = malloc((r->hit_count ? r->hit_count : 1) * sizeof(FoldedStack));
+  size_t       count   = 0;
+  const char  *current = r->files[0].path;
+  int          rc      = 0;
+
+  if (!stacks) return -1;
+  for (size_t i = 0; i < r->hit_count; i++) {
+    const ProfileHit *h = &r->hits[i];
+    if (h->file < 0 || h->us == 0) continue;
+
+    const char *path    = r->files[h->file].path;
+    Boolean     foreign = ((size_t)h->file >= r->bundled);
+    if (!h->frames && !foreign) current = path;
+
+    size_t len = strlen(current) + (foreign ? strlen(path) : 0) +
+                 (h->frames ? strlen(h->frames) : 0) + 32;
+    char  *stack = malloc(len);
+    if (!stack) {
+      rc = -1;
+      break;
+    }
+    int n = snprintf(stack, len, "bundle;%s", current);
+    if (foreign && !h->frames) n += snprintf(stack + n, len - (size_t)n, ";source %s", path);
+    if (h->frames)             snprintf(stack + n, len - (size_t)n, ";%s", h->frames);
+    stacks[count].stack = stack;
+    stacks[count++].us  = h->us;
+  }
+
+  qsort(stacks, count, sizeof(FoldedStack), compare_folded);
+  for (size_t i = 0; i < count; ) {
+    size_t  j  = i;
+    int64_t us = 0;
+    for (; j < count && strcmp(stacks[j].stack, stacks[i].stack) == 0; j++) us += stacks[j].us;
+    if (rc == 0) printf("%s %lld\n", stacks[i].stack, (long long)us);
+    i = j;
+  }
+  for (size_t i = 0; i < count; i++) free(stacks[i].stack);
+  free(stacks);
+  return rc;
+}
+
+static void profile_free(ProfileReport *r) {
+  for (size_t i = 0; i < r->file_count; i++) free(r->files[i].path);
+  for (size_t i = 0; r->hits && i < r->hit_count; i++) {
+    free(r->hits[i].word);
+    free(r->hits[i].frames);
+  }
+  free(r->files);
+  free(r->hits);
+  free(r->line_starts);
+  memset(r, 0, sizeof(*r));
+}
+
+/**
+ * Sources bundle_path in shell with the trace going to trace_path, then
+ * parses the trace and classifies command words through the same shell.
+ * Returns 0 or -1.
+ */
+static int profile_run(const char *shell, const char *bundle_path, const char *trace_path,
+                       ProfileReport *r) {
+  int     to_shell[2];
+  int     from_shell[2];
+  char    ready[16];
+  int     rc      = -1;
+  int     wstatus = 0;
+  Boolean early   = Falsehood;
+  Boolean zsh     = (strcmp(shell, SUB_ZSH) == 0);
+
+  if (pipe(to_shell) != 0) return -1;
+  if (pipe(from_shell) != 0) {
+    close(to_shell[0]);
+    close(to_shell[1]);
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(to_shell[0], STDIN_FILENO);
+    dup2(from_shell[1], STDOUT_FILENO);
+    close(to_shell[0]);
+    close(to_shell[1]);
+    close(from_shell[0]);
+    close(from_shell[1]);
+    if (zsh) execlp(shell, shell, "-f", "-c", PROFILE_ZSH, PROFILE_ARGV0, bundle_path, trace_path, (char *)NULL);
+    else     execlp(shell, shell, "--noprofile", "--norc", "-c", PROFILE_BASH, PROFILE_ARGV0,
+                    bundle_path, trace_path, (char *)NULL);
+    fprintf(stderr, "scriptsort: cannot run %s: %s\n", shell, strerror(errno));
+    _exit(127);
+  }
+  close(to_shell[0]);
+  close(from_shell[1]);
+
+  FILE *answers = pid > 0 ? fdopen(from_shell[0], "r") : NULL;
+  if (!answers) {
+    close(from_shell[0]);
+  } else if (!fgets(ready, sizeof(ready), answers) || strcmp(ready, "ready\n") != 0) {
+    early = Truth;
+  } else {
+    int         fd   = open(trace_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char       *map  = NULL;
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) map = map_script(fd, (size_t)st.st_size);
+    if (map && profile_read_trace(map, (size_t)st.st_size, bundle_path, r) == 0) {
+      profile_classify(r, to_shell[1], answers);
+      rc = 0;
+    } else {
+      fprintf(stderr, "scriptsort: no timed trace from %s; it needs $EPOCHREALTIME "
+                      "(bash 5 or zsh)\n", shell);
+    }
+    if (map) munmap(map, (size_t)st.st_size);
+    if (fd >= 0) close(fd);
+  }
+
+  /* End of input ends the shell's answer loop */
+  close(to_shell[1]);
+  if (answers) fclose(answers);
+  if (pid > 0) waitpid(pid, &wstatus, 0);
+
+  /* 127 is the child's own exec failure, already reported */
+  if (early && !(WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 127))
+    fprintf(stderr, "scriptsort: %s exited while sourcing the bundle\n", shell);
+  return rc;
+}
+
+static int profile_main(int argc, char **argv) {
+  const char  *directory    = NULL;
+  const char  *scripts_dir  = NULL;
+  const char  *shell        = NULL;
+  unsigned int cutoff_count = 50;
+  unsigned int top          = 10;
+  Boolean      folded       = Falsehood;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      print_subcommand_help("scriptsort", find_subcommand("profile"));
+      return EXIT_SUCCESS;
+    } else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--scripts-dir") == 0) && i + 1 < argc) {
+      scripts_dir = argv[++i];
+    } else if (strcmp(argv[i], "--shell") == 0 && i + 1 < argc) {
+      shell = argv[++i];
+      if (strcmp(shell, SUB_BASH) != 0 && strcmp(shell, SUB_ZSH) != 0) {
+        fprintf(stderr, SGR_RED "--shell must be bash or zsh\n" SGR_RESET);
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--cutoff") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n <= 0) {
+        fprintf(stderr, SGR_RED "--cutoff requires a number greater than 0\n" SGR_RESET);
+        return EXIT_FAILURE;
+      }
+      cutoff_count = (unsigned int)n;
+    } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+      int n = atoi(argv[++i]);
+      if (n <= 0) {
+        fprintf(stderr, SGR_RED "--top requires a number greater than 0\n" SGR_RESET);
+        return EXIT_FAILURE;
+      }
+      top = (unsigned int)n;
+    } else if (strcmp(argv[i], "--folded") == 0) {
+      folded = Truth;
+    } else if (argv[i][0] != '-' && !directory && !scripts_dir) {
+      directory = argv[i];
+    } else {
+      fprintf(stderr, SGR_RED "Unknown argument: %s\n" SGR_RESET, argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!directory && !scripts_dir) {
+    print_subcommand_help("scriptsort", find_subcommand("profile"));
+    return EXIT_FAILURE;
+  }
+  if (!shell) shell = detect_shell_subdir(NULL);
+  if (!shell) shell = SUB_BASH;
+
+  /* The bundle and its trace live in a private directory for the run */
+  const char *tmp = getenv("TMPDIR");
+  char        dir[PATH_MAX - 16];
+  char        bundle_path[PATH_MAX];
+  char        trace_path[PATH_MAX];
+
+  snprintf(dir, sizeof(dir), "%s/scriptsort-profile.XXXXXX", tmp && tmp[0] ? tmp : "/tmp");
+  if (!mkdtemp(dir)) {
+    fprintf(stderr, "scriptsort: cannot create '%s': %s\n", dir, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  snprintf(bundle_path, sizeof(bundle_path), "%s/bundle.sh", dir);
+  snprintf(trace_path, sizeof(trace_path), "%s/trace", dir);
+
+  BundleSpec    spec   = { directory, scripts_dir, scripts_dir ? shell : NULL, cutoff_count, Falsehood };
+  LoadOptions   load   = { 1, ENGINE_SYNC, Falsehood };
+  BundleSource  sources[2];
+  LoadStats     stats;
+  Emitter       em;
+  ProfileReport report;
+  struct stat   st;
+  char         *text   = NULL;
+  int           status = EXIT_FAILURE;
+
+  memset(&stats, 0, sizeof(stats));
+  memset(&report, 0, sizeof(report));
+  int fd = open(bundle_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "scriptsort: cannot create '%s': %s\n", bundle_path, strerror(errno));
+    rmdir(dir);
+    return EXIT_FAILURE;
+  }
+
+  int count = plan_bundle_sources(&spec, sources);
+  int rc    = -1;
+  if (!directory || scan_bundle_sources(sources, 1, cutoff_count, 1) == 1) {
+    emit_init(&em, fd);
+    rc = bundle_generate(&em, &spec, sources, &count, &load, &stats, NULL);
+  }
+  free_bundle_sources(sources, count);
+  if (rc != 0 || fstat(fd, &st) != 0 || st.st_size == 0) goto done;
+
+  text = map_script(fd, (size_t)st.st_size);
+  if (!text || profile_read_bundle(text, (size_t)st.st_size, &report) != 0) goto done;
+
+  /* Without a terminal to read, a pipe closing early must not kill us */
+  signal(SIGPIPE, SIG_IGN);
+  if (profile_run(shell, bundle_path, trace_path, &report) == 0) {
+    if (!folded)                                 profile_print(&report, text, shell, top);
+    else if (profile_print_folded(&report) != 0) goto done;
+    status = EXIT_SUCCESS;
+  }
+
+done:
+  if (text) munmap(text, (size_t)st.st_size);
+  close(fd);
+  profile_free(&report);
+  unlink(trace_path);
+  unlink(bundle_path);
+  rmdir(dir);
+  return status;
+}
+
+/* =========================================================================
+ * edit subcommand
+ * ====================================================================== */
+
+static int edit_main(int argc, char **argv) {
+  const char *sub_dir       = SUB_SHARED;
+  const char *filename      = NULL;
+  char       *input_content = NULL;
+  char       *full_path     = NULL;
+  Command     cmd           = CMD_NONE;
+  int         force = 0, quiet = 0, alloc_content = 0;
+  FILE       *fp;
+
+  FlagDef f_bash   = { NULL, "--bash",   NULL, NULL };
+  FlagDef f_zsh    = { NULL, "--zsh",    NULL, NULL };
+  FlagDef f_shared = { NULL, "--shared", NULL, NULL };
+  FlagDef f_force  = { "-f", "--force",  NULL, NULL };
+  FlagDef f_quiet  = { "-q", "--quiet",  NULL, NULL };
+  FlagDef f_help   = { "-h", "--help",   NULL, NULL };
+
+  FlagDef cmd_write  = { NULL, "write",  NULL, NULL };
+  FlagDef cmd_append = { NULL, "append", NULL, NULL };
+  FlagDef cmd_remove = { NULL, "remove", NULL, NULL };
+
+  if (argc < 2) {
+    print_subcommand_help("scriptsort", find_subcommand("edit"));
+    return EXIT_FAILURE;
+  }
+
+  int i = 1;
+
+  /* 1. Directory selector flags */
+  for (; i < argc; i++) {
+    if      (FlagMatches(f_help,   argv[i])) { print_subcommand_help("scriptsort", find_subcommand("edit")); return EXIT_SUCCESS; }
+    else if (FlagMatches(f_bash,   argv[i])) sub_dir = SUB_BASH;
+    else if (FlagMatches(f_zsh,    argv[i])) sub_dir = SUB_ZSH;
+    else if (FlagMatches(f_shared, argv[i])) sub_dir = SUB_SHARED;
+    else break;
+  }
+
+  /* 2. Operation */
+  if (i >= argc) {
+    print_subcommand_help("scriptsort", find_subcommand("edit"));
+    return EXIT_FAILURE;
+  }
+
+  if      (FlagMatches(cmd_write,  argv[i])) cmd = CMD_WRITE;
+  else if (FlagMatches(cmd_append, argv[i])) cmd = CMD_APPEND;
+  else if (FlagMatches(cmd_remove, argv[i])) cmd = CMD_REMOVE;
+  else {
+    fprintf(stderr, SGR_RED "Unknown edit command: %s\n" SGR_RESET, argv[i]);
+    return EXIT_FAILURE;
+  }
+  i++;
+
+  /* 3. Operation flags and arguments */
+  for (; i < argc; i++) {
+    if      (FlagMatches(f_force, argv[i])) force = 1;
+    else if (FlagMatches(f_quiet, argv[i])) quiet = 1;
+    else if (!filename)      filename = argv[i];
+    else if (!input_content) input_content = argv[i];
+  }
+
+  if (!filename) {
+    fprintf(stderr, SGR_RED "Error:" SGR_RESET " Filename required.\n");
+    return EXIT_FAILURE;
+  }
+
+  full_path = build_path(sub_dir, filename);
+  if (!full_path) return EXIT_FAILURE;
+
+  /* 4. Read from STDIN when no inline content was supplied */
+  if (cmd != CMD_REMOVE && !input_content) {
+    input_content = read_stdin_to_buffer();
+    alloc_content = 1;
+    if (!input_content) { free(full_path); return EXIT_FAILURE; }
+  }
+
+  /* 5. Execute */
+  if (cmd == CMD_WRITE) {
+    if (file_exists(full_path) && !force) {
+      fprintf(stderr, SGR_RED "Error:" SGR_RESET " File exists. Use -f to overwrite.\n");
+      if (alloc_content) free(input_content);
+      free(full_path);
+      return EXIT_FAILURE;
+    }
+    fp = fopen(full_path, "w");
+    if (!fp) perror("fopen");
+    else { fputs(input_content, fp); fclose(fp); if (!quiet) printf("%s\n", filename); }
+
+  } else if (cmd == CMD_APPEND) {
+    fp = fopen(full_path, "a");
+    if (!fp) perror("fopen");
+    else { fprintf(fp, "\n%s", input_content); fclose(fp); if (!quiet) printf("%s\n", filename); }
+
+  } else if (cmd == CMD_REMOVE) {
+    if (unlink(full_path) != 0) perror("unlink");
+  }
+
+  /* Rewriting a file in place leaves its directory's mtime alone, but
+   * startup hooks only compare directory mtimes against the cache. */
+  if (cmd != CMD_REMOVE) touch_parent_dir(full_path);
+
+  if (alloc_content) free(input_content);
+  free(full_path);
+  return EXIT_SUCCESS;
+}
+
+/* =========================================================================
+ * Low-level utilities
+ * ====================================================================== */
+
+static const char *find_last_path_separator(const char *path) {
+  const char *fwd  = strrchr(path, '/');
+  const char *back = strrchr(path, '\\');
+  if (!fwd)  return back;
+  if (!back) return fwd;
+  return (fwd > back) ? fwd : back;
+}
+
+static int extract_order_number(const char *filename) {
+  if (strncmp(filename, "ordered.", 8) != 0) return -1;
+  char *endptr;
+  long num = strtol(filename + 8, &endptr, 10);
+  if (endptr == filename + 8 || num < 0 || num > INT_MAX) return -1;
+  return (int)num;
+}
+
+/* Returns a pointer to the suffix of an ordered filename — the part after
+ * "ordered.<digits>." — so that same-group files sort by intended name
+ * rather than by digit formatting (e.g. "001" vs "01" vs "1").
+ * For non-ordered filenames, returns the full name unchanged. */
+static const char *extract_suffix(const char *filename) {
+  if (strncmp(filename, "ordered.", 8) != 0) return filename;
+  const char *p = filename + 8;
+  while (isdigit((unsigned char)*p)) p++;
+  return (*p == '.') ? p + 1 : p;
+}
+
+/* Packs the first 8 bytes of s (zero-padded past the NUL) big-endian, so
+ * comparing two prefixes as integers agrees with strcmp on those bytes. */
+static uint64_t pack_sort_prefix(const char *s) {
+  uint64_t key = 0;
+  int      i   = 0;
+  for (; i < 8 && s[i]; i++) key = (key << 8) | (unsigned char)s[i];
+  return key << (8 * (8 - i));
+}
+
+/* Orders two entries by sort string (suffix for ordered files, full name
+ * otherwise). The packed prefix settles most pairs without touching names. */
+static int compare_entry_keys(const FileEntry *a, const FileEntry *b, const char *names) {
+  if (a->sort_prefix != b->sort_prefix) return a->sort_prefix < b->sort_prefix ? -1 : 1;
+  return strcmp(names + a->name_off + a->suffix_off, names + b->name_off + b->suffix_off);
+}
+
+static int compare_name_keys(const void *a, const void *b) {
+  return compare_entry_keys((const FileEntry *)a, (const FileEntry *)b, sort_names);
+}
+
+static void sort_by_name_key(FileEntry *v, size_t n, const char *names) {
+  if (n > INSERTION_SORT_MAX) {
+    sort_names = names;
+    qsort(v, n, sizeof(FileEntry), compare_name_keys);
+    sort_names = NULL;
+    return;
+  }
+  for (size_t i = 1; i < n; i++) {
+    FileEntry key = v[i];
+    size_t    j   = i;
+    while (j > 0 && compare_entry_keys(&v[j - 1], &key, names) > 0) {
+      v[j] = v[j - 1];
+      j--;
+    }
+    v[j] = key;
+  }
+}
+
+/**
+ * Sorts ordered entries by order number with an LSD radix pass per key
+ * byte, skipping bytes every key shares (one pass for the usual small
+ * numbers), then tie-breaks each run of equal numbers by suffix.
+ * tmp must hold at least n entries.
+ */
+static void sort_by_order_number(FileEntry *v, size_t n, FileEntry *tmp, const char *names) {
+  if (n < 2) return;
+
+  FileEntry *src = v, *dst = tmp;
+  for (int shift = 0; shift < 32; shift += 8) {
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < n; i++)
+      counts[((unsigned int)src[i].order_num >> shift) & 0xFF]++;
+    if (counts[((unsigned int)src[0].order_num >> shift) & 0xFF] == n)
+      continue;
+
+    size_t pos = 0;
+    for (int b = 0; b < 256; b++) {
+      size_t c  = counts[b];
+      counts[b] = pos;
+      pos      += c;
+    }
+    for (size_t i = 0; i < n; i++)
+      dst[counts[((unsigned int)src[i].order_num >> shift) & 0xFF]++] = src[i];
+
+    FileEntry *t = src; src = dst; dst = t;
+  }
+  if (src != v) memcpy(v, src, n * sizeof(FileEntry));
+
+  for (size_t i = 0, j; i < n; i = j) {
+    for (j = i + 1; j < n && v[j].order_num == v[i].order_num; j++) ;
+    if (j - i > 1) sort_by_name_key(v + i, j - i, names);
+  }
+}
+
+/**
+ * Opens filename relative to dir_fd and fills st from fstat() on the same
+ * fd, so the path is resolved exactly once. directory is only used for
+ * error messages. Returns the fd, or -1 (error printed to stderr).
+ */
+static int open_script(int dir_fd, const char *directory, const char *filename, struct stat *st) {
+  int fd = openat(dir_fd, filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Error opening file '%s/%s': %s\n", directory, filename, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, st) != 0) {
+    fprintf(stderr, "Error getting file size for '%s/%s': %s\n", directory, filename, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Reads up to expected bytes of an open file straight into a new
+ * NUL-terminated buffer. A file that shrinks mid-read ends early at EOF;
+ * growth is ignored. Each read() is added to *calls. Returns NULL on
+ * failure (error printed to stderr).
+ */
+static char *read_open_file(int fd, const char *directory, const char *filename,
+                            size_t expected, size_t *size, unsigned int *calls) {
+  char *contents = malloc(expected + 1);
+  if (!contents) {
+    fprintf(stderr, "Error allocating memory for file '%s/%s'\n", directory, filename);
+    return NULL;
+  }
+
+  size_t bytes_read = 0;
+  while (bytes_read < expected) {
+    ssize_t n = read(fd, contents + bytes_read, expected - bytes_read);
+    (*calls)++;
+    if (n == 0) break;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Error reading file '%s/%s': %s\n", directory, filename, strerror(errno));
+      free(contents);
+      return NULL;
+    }
+    bytes_read += (size_t)n;
+  }
+
+  contents[bytes_read] = '\0';
+  *size = bytes_read;
+  return contents;
+}
+
+static size_t count_lines(const char *content, size_t size) {
+  size_t count = count_newlines(content, size);
+  if (size > 0 && content[size - 1] != '\n') count++;
+  return count;
+}
+
+/* =========================================================================
+ * Bundle output
+ * ====================================================================== */
+
+/* Picks the zero-copy strategy the output fd supports, if any, and whether
+ * output should be streamed file by file rather than batched. */
+static void emit_init(Emitter *em, int fd) {
+  struct stat st;
+
+  memset(em, 0, sizeof(*em));
+  em->fd       = fd;
+  em->transfer = TRANSFER_BUFFERED;
+  if (fstat(fd, &st) != 0) return;
+
+#ifdef __linux__
+  if      (S_ISFIFO(st.st_mode)) em->transfer = TRANSFER_SPLICE;
+  else if (S_ISREG(st.st_mode))  em->transfer = TRANSFER_COPY_RANGE;
+#endif
+  /* Someone is reading as we go (process substitution, socket): stream */
+  em->stream = (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) ? Truth : Falsehood;
+}
+
+/**
+ * Formats generated text into the staging area, extending the previous
+ * segment when that is staged text too. Text too large for an empty
+ * staging area is heap-formatted and queued as an owned segment.
+ * Returns 0 on success, -1 on write or allocation failure.
+ */
+static int emit_text(Emitter *em, const char *fmt, ...) {
+  va_list ap;
+  int     len = 0;
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    size_t room = EMIT_TEXT_SIZE - em->text_used;
+    char  *at   = em->text + em->text_used;
+
+    va_start(ap, fmt);
+    len = vsnprintf(at, room, fmt, ap);
+    va_end(ap);
+    if (len < 0) return -1;
+
+    if ((size_t)len < room) {
+      struct iovec *last = em->count ? &em->iov[em->count - 1] : NULL;
+      if (last && !em->owned[em->count - 1] && (char *)last->iov_base + last->iov_len == at) {
+        last->iov_len += (size_t)len;
+      } else if (em->count < EMIT_IOV_BATCH) {
+        em->iov[em->count].iov_base = at;
+        em->iov[em->count].iov_len  = (size_t)len;
+        em->owned[em->count++]      = NULL;
+      } else {
+        if (emit_flush(em) != 0) return -1;
+        continue;
+      }
+      em->text_used += (size_t)len;
+      em->total     += (size_t)len;
+      return 0;
+    }
+
+    if (emit_flush(em) != 0) return -1;
+  }
+
+  char *big = malloc((size_t)len + 1);
+  if (!big) {
+    fprintf(stderr, "Cannot allocate %d bytes of bundle text\n", len + 1);
+    return -1;
+  }
+  va_start(ap, fmt);
+  vsnprintf(big, (size_t)len + 1, fmt, ap);
+  va_end(ap);
+  return emit_owned(em, big, (size_t)len);
+}
+
+/* Queues len bytes at data and takes ownership; data is freed once written. */
+static int emit_owned(Emitter *em, void *data, size_t len) {
+  if (em->count == EMIT_IOV_BATCH && emit_flush(em) != 0) {
+    free(data);
+    return -1;
+  }
+  em->iov[em->count].iov_base = data;
+  em->iov[em->count].iov_len  = len;
+  em->mapped[em->count]       = 0;
+  em->owned[em->count++]      = data;
+  em->total                  += len;
+  return 0;
+}
+
+/* Like emit_owned() for a mapping of len bytes; it is unmapped once written. */
+static int emit_mapped(Emitter *em, void *map, size_t len) {
+  if (em->count == EMIT_IOV_BATCH && emit_flush(em) != 0) {
+    munmap(map, len);
+    return -1;
+  }
+  em->iov[em->count].iov_base = map;
+  em->iov[em->count].iov_len  = len;
+  em->mapped[em->count]       = len;
+  em->owned[em->count++]      = map;
+  em->total                  += len;
+  return 0;
+}
+
+/**
+ * Writes every queued segment with writev(), resuming after partial
+ * writes. EFAULT means a mapped script was truncated under us; the
+ * segments are then written one at a time, and the one that faults on
+ * its own loses the rest of its bytes, as when emit_file() finds a file
+ * shrank.
+ */
+static int emit_flush(Emitter *em) {
+  struct iovec *iov    = em->iov;
+  int           cnt    = em->count;
+  Boolean       single = Falsehood;
+  int           rc     = 0;
+
+  while (cnt > 0) {
+    ssize_t n = writev(em->fd, iov, single ? 1 : cnt);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EFAULT && !single) {
+        single = Truth;
+        continue;
+      }
+      if (errno == EFAULT && em->mapped[iov - em->iov]) {
+        iov++;
+        cnt--;
+        continue;
+      }
+      fprintf(stderr, "Error writing bundle: %s\n", strerror(errno));
+      rc = -1;
+      break;
+    }
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= (ssize_t)iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
+  }
+
+  for (int i = 0; i < em->count; i++) {
+    if (em->mapped[i]) munmap(em->owned[i], em->mapped[i]);
+    else               free(em->owned[i]);
+  }
+  em->count     = 0;
+  em->text_used = 0;
+  return rc;
+}
+
+/**
+ * Writes len bytes of fd, starting at offset, after everything already
+ * queued. The emitter's zero-copy strategy is tried first; if the kernel
+ * refuses it for this pair of fds, the emitter falls back to sendfile()
+ * and then to a bounce buffer, and stays there for the rest of the bundle.
+ */
+static int emit_file(Emitter *em, int fd, off_t offset, size_t len) {
+  off_t  off  = offset;
+  size_t done = 0;
+
+  if (emit_flush(em) != 0) return -1;
+
+#ifdef __linux__
+  while (done < len && em->transfer != TRANSFER_BUFFERED) {
+    ssize_t n;
+    if      (em->transfer == TRANSFER_SPLICE)     n = splice(fd, &off, em->fd, NULL, len - done, SPLICE_F_MOVE);
+    else if (em->transfer == TRANSFER_COPY_RANGE) n = copy_file_range(fd, &off, em->fd, NULL, len - done, 0);
+    else                                          n = sendfile(em->fd, fd, &off, len - done);
+
+    if (n > 0) { done += (size_t)n; continue; }
+    if (n == 0) break;      /* file shrank since it was sized */
+    if (errno == EINTR) continue;
+
+    if (done == 0 && (errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+                      errno == EBADF  || errno == EOPNOTSUPP)) {
+      em->transfer = (em->transfer == TRANSFER_SENDFILE) ? TRANSFER_BUFFERED : TRANSFER_SENDFILE;
+      continue;
+    }
+    fprintf(stderr, "Error writing bundle: %s\n", strerror(errno));
+    return -1;
+  }
+#endif
+
+  if (done == len || em->transfer != TRANSFER_BUFFERED) {
+    em->total += done;
+    return 0;
+  }
+
+  char *chunk = malloc(TRANSFER_CHUNK);
+  if (!chunk) {
+    fprintf(stderr, "Cannot allocate transfer buffer\n");
+    return -1;
+  }
+  while (done < len) {
+    size_t  want = (len - done < TRANSFER_CHUNK) ? len - done : TRANSFER_CHUNK;
+    ssize_t n    = pread(fd, chunk, want, off);
+    if (n == 0) break;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "Error reading file for bundle: %s\n", strerror(errno));
+      free(chunk);
+      return -1;
+    }
+    for (ssize_t w = 0; w < n; ) {
+      ssize_t m = write(em->fd, chunk + w, (size_t)(n - w));
+      if (m < 0) {
+        if (errno == EINTR) continue;
+        fprintf(stderr, "Error writing bundle: %s\n", strerror(errno));
+        free(chunk);
+        return -1;
+      }
+      w += m;
+    }
+    off  += n;
+    done += (size_t)n;
+  }
+  free(chunk);
+  em->total += done;
+  return 0;
+}
+
+/**
+ * Counts the lines of an open file through a read-only mapping, so no
+ * file bytes are copied into user space. Returns -1 when the file cannot
+ * be mapped and should be read the ordinary way instead.
+ */
+static int count_mapped_lines(int fd, size_t size, size_t *lines) {
+  *lines = 0;
+  if (size == 0) return 0;
+
+  void *map = map_script(fd, size);
+  if (!map) return -1;
+  int rc = count_guarded_lines(map, size, lines);
+  munmap(map, size);
+  return rc;
+}
+
+/* Where a SIGBUS on this thread returns to, while it reads a mapping */
+static __thread sigjmp_buf *mapping_fault_jump = NULL;
+static pthread_once_t       mapping_fault_once = PTHREAD_ONCE_INIT;
+
+static void on_mapping_fault(int sig) {
+  if (mapping_fault_jump) siglongjmp(*mapping_fault_jump, 1);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static void install_mapping_fault_handler(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_mapping_fault;
+  sigaction(SIGBUS, &sa, NULL);
+}
+
+/**
+ * Counts the lines of a script mapping. Touching a page past the end of a
+ * file that was truncated after it was sized raises SIGBUS; that is caught
+ * and -1 returned, so the caller reads the file instead of dying halfway
+ * through the bundle.
+ */
+static int count_guarded_lines(const char *map, size_t size, size_t *lines) {
+  sigjmp_buf jump;
+
+  pthread_once(&mapping_fault_once, install_mapping_fault_handler);
+  if (sigsetjmp(jump, 1) != 0) {
+    mapping_fault_jump = NULL;
+    *lines = 0;
+    return -1;
+  }
+  mapping_fault_jump = &jump;
+  *lines = count_lines(map, size);
+  mapping_fault_jump = NULL;
+  return 0;
+}
+
+/**
+ * Maps size bytes of an open script read-only and tells the kernel the
+ * pages will be read front to back, once. Returns NULL if mapping fails.
+ */
+static void *map_script(int fd, size_t size) {
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return NULL;
+#ifdef MADV_SEQUENTIAL
+  madvise(map, size, MADV_SEQUENTIAL);
+#endif
+  return map;
+}
+
+/* =========================================================================
+ * Atomic output file (bundle --output)
+ *
+ * The bundle is generated into a temporary file beside the destination,
+ * which stands in for stdout, and renamed over it only once complete, so
+ * a shell starting mid-run sources either the old bundle or the new one.
+ * A result identical to the current file is dropped instead, leaving the
+ * destination's mtime alone for anything that watches it.
+ * ====================================================================== */
+
+/**
+ * Creates the temporary file for out->path and moves it onto stdout. It
+ * takes the destination's permissions, or the umask's for a new file.
+ * Returns 0, or -1 with the error printed.
+ */
+static int output_begin(OutputFile *out, const char *path) {
+  struct stat st;
+  mode_t      mode;
+
+  out->path = path;
+  if (snprintf(out->temp_path, sizeof(out->temp_path), "%s.XXXXXX", path) >= (int)sizeof(out->temp_path)) {
+    out->temp_path[0] = '\0';
+    fprintf(stderr, "scriptsort: output path too long: %s\n", path);
+    return -1;
+  }
+  int fd = mkstemp(out->temp_path);
+  if (fd < 0) {
+    fprintf(stderr, "scriptsort: cannot write '%s': %s\n", path, strerror(errno));
+    out->temp_path[0] = '\0';
+    return -1;
+  }
+
+  if (stat(path, &st) == 0) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+  if (fchmod(fd, mode) != 0 || dup2(fd, STDOUT_FILENO) < 0) {
+    fprintf(stderr, "scriptsort: cannot prepare '%s': %s\n", out->temp_path, strerror(errno));
+    close(fd);
+    output_abort(out);
+    return -1;
   }
+  close(fd);
+  return 0;
+}
 
-  SortedDir sd;
-  if (load_sorted_dir(directory, cutoff_count, &sd) != 0)
-    return EXIT_FAILURE;
+/* Reports whether two open files hold the same bytes. */
+static Boolean same_contents(int a, int b) {
+  struct stat sa;
+  struct stat sb;
+
+  if (fstat(a, &sa) != 0 || fstat(b, &sb) != 0 || !S_ISREG(sb.st_mode) ||
+      sa.st_size != sb.st_size) return Falsehood;
+  if (sa.st_size == 0) return Truth;
+
+  size_t  size  = (size_t)sa.st_size;
+  void   *map_a = map_script(a, size);
+  void   *map_b = map_a ? map_script(b, size) : NULL;
+  Boolean same  = (map_b && memcmp(map_a, map_b, size) == 0);
+  if (map_a) munmap(map_a, size);
+  if (map_b) munmap(map_b, size);
+  return same;
+}
 
-  String buffer = calloc(1, (size_t)sd.total_bytesize + 1);
-  if (!buffer) {
-    fprintf(stderr, "Cannot allocate buffer\n");
-    return EXIT_FAILURE;
+/**
+ * Puts the finished bundle (on stdout) in place: renamed over out->path,
+ * or discarded when out->path already holds the same bytes. Returns 0,
+ * or -1 with the error printed.
+ */
+static int output_commit(OutputFile *out) {
+  int     fd   = open(out->path, O_RDONLY | O_CLOEXEC);
+  Boolean same = (fd >= 0 && same_contents(STDOUT_FILENO, fd));
+  if (fd >= 0) close(fd);
+
+  if (same) {
+    output_abort(out);
+    return 0;
   }
+  if (rename(out->temp_path, out->path) != 0) {
+    fprintf(stderr, "scriptsort: cannot write '%s': %s\n", out->path, strerror(errno));
+    output_abort(out);
+    return -1;
+  }
+  out->temp_path[0] = '\0';
+  return 0;
+}
 
-  size_t cur = 0;
-  for (int i = 0; i < sd.lower_count;     i++) cur += (size_t)sprintf(buffer + cur, "%s ", sd.lower_files[i].name);
-  for (int i = 0; i < sd.unordered_count; i++) cur += (size_t)sprintf(buffer + cur, "%s ", sd.unordered_files[i].name);
-  for (int i = 0; i < sd.upper_count;     i++) cur += (size_t)sprintf(buffer + cur, "%s ", sd.upper_files[i].name);
-  (void)cur;
-
-  const char *debugStart = debugtext
-    ? "    printf \"Sourcing \\\"${scriptpath}\\\"...\"\n" : "\n";
-  const char *debugEnd   = debugtext
-    ? "    printf \"done\\n\"\n" : "";
-  const char *timer = "$(command 2>&1 >/dev/null -v ms && ms || printf '0')";
-
-  const char script[] = (
-    "pjoin() {\n"
-    "  local -a parts\n"
-    "\n"
-    "  if [[ \"${#}\" -lt 1 ]]; then\n"
-    "    printf \"\\x1b[1;35mpjoin\\x1b[22;39m <path> <part> ...\\n\\n\"\n"
-    "    printf \"Example:\\n\"\n"
-    "    printf \"  pjoin \\$HOME .zshrc\\n\"\n"
-    "    printf \"  \\x1b[3m/Users/${USER}/.zshrc\\x1b[33m\\n\"\n"
-    "    return 0\n"
-    "  fi\n"
-    "\n"
-    "  for part in \"${@}\"; do\n"
-    "    parts+=( \"${part}\" \"/\" )\n"
-    "  done\n"
-    "\n"
-    "  printf \"$(realpath $(printf \"${parts// /}\"))\"\n"
-    "}\n"
-    "\n"
-    "includeScripts() {\n"
-    "  local -a scripts\n"
-    "  local -a timings\n"
-    "  local directory=\"${1:-${HOME}/.zsh.scripts}\"\n"
-    "  local scriptpath=\"\"\n"
-    "  local timer\n"
-    "  local now\n"
-    "  local elapsed\n"
-    "\n"
-    "  scripts=( %s )\n"
-    "  for script in \"${scripts[@]}\"; do\n"
-    "    timer=%s\n"
-    "    scriptpath=$(pjoin \"${directory}\" \"${script}\")\n"
-    "%s"
-    "    source \"${scriptpath}\"\n"
-    "    if [ $timer ]; then\n"
-    "      now=%s\n"
-    "      elapsed=$(($now-$timer))\n"
-    "\n"
-    "      timings+=( \"${elapsed}ms:${scriptpath}\" )\n"
-    "    fi\n"
-    "%s"
-    "  done\n"
-    "}\n\n"
-    "includeScripts \"%s\"\n"
-    "unset -f includeScripts\n"
-  );
-
-  printf(script, buffer, timer, debugStart, timer, debugEnd, directory);
-  free(buffer);
-  return EXIT_SUCCESS;
+/* Removes the temporary file of an output that is not being committed. */
+static void output_abort(OutputFile *out) {
+  if (out->temp_path[0]) unlink(out->temp_path);
+  out->temp_path[0] = '\0';
 }
 
 /* =========================================================================
- * edit subcommand
+ * Bundle cache (bundle --cache)
+ *
+ * <key>.sh holds a generated bundle and <key>.manifest the metadata it was
+ * built from:
+ *
+ *   scriptsort-manifest 2
+ *   B <bundle ino> <bundle size>
+ *   D <mtime_ns> <directory>                   one per watched directory
+ *   F <dir> <ino> <size> <mtime_ns> <offset> <lines> <name>
+ *                                              one per bundled file
+ *
+ * Adding, removing or renaming a file changes its directory's mtime, and
+ * editing one changes its own size or mtime, so a manifest that still
+ * matches proves the cached bytes are what a fresh run would produce.
+ * When it does not, each F line still locates that file's body in the old
+ * bundle, and files whose metadata is unchanged are copied from there
+ * rather than read again.
  * ====================================================================== */
 
-static int edit_main(int argc, char **argv) {
-  const char *sub_dir       = SUB_SHARED;
-  const char *filename      = NULL;
-  char       *input_content = NULL;
-  char       *full_path     = NULL;
-  Command     cmd           = CMD_NONE;
-  int         force = 0, quiet = 0, alloc_content = 0;
-  FILE       *fp;
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= FNV1A_PRIME;
+  }
+  return hash;
+}
 
-  FlagDef f_bash   = { NULL, "--bash",   NULL, NULL };
-  FlagDef f_zsh    = { NULL, "--zsh",    NULL, NULL };
-  FlagDef f_shared = { NULL, "--shared", NULL, NULL };
-  FlagDef f_force  = { "-f", "--force",  NULL, NULL };
-  FlagDef f_quiet  = { "-q", "--quiet",  NULL, NULL };
-  FlagDef f_help   = { "-h", "--help",   NULL, NULL };
+static int64_t stat_mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+  return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+  return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
 
-  FlagDef cmd_write  = { NULL, "write",  NULL, NULL };
-  FlagDef cmd_append = { NULL, "append", NULL, NULL };
-  FlagDef cmd_remove = { NULL, "remove", NULL, NULL };
+/* Creates path and any missing parents with mode 0700, like mkdir -p. */
+static int make_dirs(const char *path) {
+  char buf[PATH_MAX];
 
-  if (argc < 2) {
-    print_subcommand_help("scriptsort", find_subcommand("edit"));
-    return EXIT_FAILURE;
+  snprintf(buf, sizeof(buf), "%s", path);
+  for (char *p = buf + 1; *p; p++) {
+    if (*p != '/') continue;
+    *p = '\0';
+    if (mkdir(buf, 0700) != 0 && errno != EEXIST) return -1;
+    *p = '/';
   }
+  return (mkdir(buf, 0700) == 0 || errno == EEXIST) ? 0 : -1;
+}
 
-  int i = 1;
+/* Fills dir with ${XDG_CACHE_HOME:-$HOME/.cache}/scriptsort. Returns -1 without either. */
+static int cache_base_dir(char *dir, size_t size) {
+  const char *xdg  = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
 
-  /* 1. Directory selector flags */
-  for (; i < argc; i++) {
-    if      (FlagMatches(f_help,   argv[i])) { print_subcommand_help("scriptsort", find_subcommand("edit")); return EXIT_SUCCESS; }
-    else if (FlagMatches(f_bash,   argv[i])) sub_dir = SUB_BASH;
-    else if (FlagMatches(f_zsh,    argv[i])) sub_dir = SUB_ZSH;
-    else if (FlagMatches(f_shared, argv[i])) sub_dir = SUB_SHARED;
-    else break;
-  }
+  if (xdg && xdg[0] == '/')  snprintf(dir, size, "%s/scriptsort", xdg);
+  else if (home && home[0])  snprintf(dir, size, "%s/.cache/scriptsort", home);
+  else                       return -1;
+  return 0;
+}
 
-  /* 2. Operation */
-  if (i >= argc) {
-    print_subcommand_help("scriptsort", find_subcommand("edit"));
-    return EXIT_FAILURE;
+/**
+ * Makes path absolute without asking the filesystem: a relative path is
+ * put under the working directory, then "//" and "." components are
+ * dropped. ".." is kept, since folding it past a symlink could name
+ * another directory. Returns -1 if the result does not fit.
+ */
+static int absolute_path(const char *path, char *out, size_t size) {
+  char   joined[PATH_MAX * 2];
+  size_t len = 0;
+
+  if (path[0] == '/') {
+    snprintf(joined, sizeof(joined), "%s", path);
+  } else {
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) return -1;
+    snprintf(joined, sizeof(joined), "%s/%s", cwd, path);
   }
 
-  if      (FlagMatches(cmd_write,  argv[i])) cmd = CMD_WRITE;
-  else if (FlagMatches(cmd_append, argv[i])) cmd = CMD_APPEND;
-  else if (FlagMatches(cmd_remove, argv[i])) cmd = CMD_REMOVE;
-  else {
-    fprintf(stderr, SGR_RED "Unknown edit command: %s\n" SGR_RESET, argv[i]);
-    return EXIT_FAILURE;
+  for (const char *p = joined; *p; ) {
+    while (*p == '/') p++;
+    const char *name = p;
+    while (*p && *p != '/') p++;
+    size_t n = (size_t)(p - name);
+    if (n == 0 || (n == 1 && name[0] == '.')) continue;
+    if (len + n + 2 > size) return -1;
+    out[len++] = '/';
+    memcpy(out + len, name, n);
+    len += n;
   }
-  i++;
+  if (len == 0) out[len++] = '/';
+  out[len] = '\0';
+  return 0;
+}
 
-  /* 3. Operation flags and arguments */
-  for (; i < argc; i++) {
-    if      (FlagMatches(f_force, argv[i])) force = 1;
-    else if (FlagMatches(f_quiet, argv[i])) quiet = 1;
-    else if (!filename)      filename = argv[i];
-    else if (!input_content) input_content = argv[i];
+/**
+ * Hashes everything that changes the bundle's bytes for spec: the
+ * version, the bundle and manifest formats, the directory (made absolute
+ * in abs), the section label, the shell and the flags. Cache entries and
+ * serve sockets are named by it. The formats are hashed as their text, so
+ * any change to the wrapper, the file headers or the manifest retires
+ * entries an older binary wrote. The directory is taken as spelled, never
+ * resolved, so a lookup costs no access to the scripts' filesystem.
+ * Returns -1 if the path is too long.
+ */
+static int bundle_key(const BundleSpec *spec, char *abs, uint64_t *key) {
+  const char *dir = spec->scripts_dir ? spec->scripts_dir : spec->directory;
+  char        flags[64];
+
+  if (absolute_path(dir, abs, PATH_MAX) != 0) return -1;
+
+  const char *sep   = find_last_path_separator(abs);
+  const char *label = sep ? sep + 1 : abs;
+  snprintf(flags, sizeof(flags), "cutoff=%u debug=%d", spec->cutoff, spec->debug ? 1 : 0);
+  const char *parts[] = {
+    SCRIPTSORT_VERSION, MANIFEST_MAGIC, BUNDLE_FILE_HEADER, BUNDLE_PREAMBLE, BUNDLE_FOOTER,
+    BUNDLE_TIMER_START, BUNDLE_TIMER_END,
+    spec->scripts_dir ? "-s" : "dir", abs, label, spec->shell_subdir ? spec->shell_subdir : "", flags
+  };
+
+  *key = FNV1A_OFFSET;
+  for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+    *key = fnv1a(*key, parts[i], strlen(parts[i]) + 1);
+  return 0;
+}
+
+/**
+ * Resolves the cache directory and the entry paths for spec. Touches
+ * nothing but the environment and the working directory, so a stale
+ * entry can be served before the scripts' filesystem is looked at.
+ * Returns -1 if there is no cache directory or a path is too long.
+ */
+static int cache_open(BundleCache *c, const BundleSpec *spec) {
+  char     abs[PATH_MAX];
+  uint64_t key;
+
+  memset(c, 0, sizeof(*c));
+  c->old_fd  = -1;
+  c->lock_fd = -1;
+  if (cache_base_dir(c->dir, sizeof(c->dir)) != 0) {
+    fprintf(stderr, "scriptsort: no cache directory (set HOME or XDG_CACHE_HOME); bundling uncached\n");
+    return -1;
   }
+  if (bundle_key(spec, abs, &key) != 0) return -1;
+
+  if (snprintf(c->bundle_path, sizeof(c->bundle_path), "%s/%016llx.sh",
+               c->dir, (unsigned long long)key) >= (int)sizeof(c->bundle_path) ||
+      snprintf(c->manifest_path, sizeof(c->manifest_path), "%s/%016llx.manifest",
+               c->dir, (unsigned long long)key) >= (int)sizeof(c->manifest_path) ||
+      snprintf(c->lock_path, sizeof(c->lock_path), "%s/%016llx.lock",
+               c->dir, (unsigned long long)key) >= (int)sizeof(c->lock_path))
+    return -1;
+  return 0;
+}
 
-  if (!filename) {
-    fprintf(stderr, SGR_RED "Error:" SGR_RESET " Filename required.\n");
-    return EXIT_FAILURE;
+/**
+ * Records the -s base directory, resolved, and its mtime for the manifest:
+ * new shared/ or shell sub-directories show up there. Runs once a stale
+ * entry has not been served, before anything is scanned. Returns -1 if
+ * the directory is gone, so an empty bundle is never cached for it.
+ */
+static int cache_stamp_base(BundleCache *c, const BundleSpec *spec) {
+  const char *dir = spec->scripts_dir ? spec->scripts_dir : spec->directory;
+  struct stat st;
+
+  c->base_path[0] = '\0';
+  if (!realpath(dir, c->base_path) || stat(c->base_path, &st) != 0) {
+    c->base_path[0] = '\0';
+    return -1;
   }
+  if (spec->scripts_dir) c->base_mtime_ns = stat_mtime_ns(&st);
+  else                   c->base_path[0]  = '\0';
+  return 0;
+}
 
-  full_path = build_path(sub_dir, filename);
-  if (!full_path) return EXIT_FAILURE;
+/* Orders segments by directory index, then name, for bsearch(). */
+static int compare_segments(const void *a, const void *b) {
+  const Segment *x = (const Segment *)a;
+  const Segment *y = (const Segment *)b;
+  if (x->dir != y->dir) return x->dir < y->dir ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
 
-  /* 4. Read from STDIN when no inline content was supplied */
-  if (cmd != CMD_REMOVE && !input_content) {
-    input_content = read_stdin_to_buffer();
-    alloc_content = 1;
-    if (!input_content) { free(full_path); return EXIT_FAILURE; }
+/**
+ * Parses a manifest, taking ownership of text. File segments end up
+ * sorted by directory and name. Returns -1 for a malformed or
+ * old-format manifest.
+ */
+static int manifest_parse(char *text, Manifest *m) {
+  size_t cap = 0;
+  char  *line;
+  char  *next;
+
+  memset(m, 0, sizeof(*m));
+  m->text = text;
+  if (strncmp(text, MANIFEST_MAGIC "\n", sizeof(MANIFEST_MAGIC)) != 0) return -1;
+
+  for (const char *p = text; *p; p++) cap += (*p == '\n');
+  m->files = malloc((cap ? cap : 1) * sizeof(Segment));
+  if (!m->files) return -1;
+
+  for (line = text + sizeof(MANIFEST_MAGIC); *line; line = next) {
+    char *end = strchr(line, '\n');
+    if (!end) return -1;
+    *end = '\0';
+    next = end + 1;
+
+    char *p = line + 2;
+    if (line[0] == 'B') {
+      m->bundle_ino  = strtoull(p, &p, 10);
+      m->bundle_size = strtoull(p, &p, 10);
+    } else if (line[0] == 'D') {
+      if (m->dir_count == CACHE_MAX_DIRS) return -1;
+      m->dir_mtimes[m->dir_count] = strtoll(p, &p, 10);
+      if (*p++ != ' ') return -1;
+      m->dirs[m->dir_count++] = p;
+    } else if (line[0] == 'F') {
+      Segment *f = &m->files[m->file_count];
+      f->dir      = (int)strtol(p, &p, 10);
+      f->ino      = strtoull(p, &p, 10);
+      f->size     = strtoull(p, &p, 10);
+      f->mtime_ns = strtoll(p, &p, 10);
+      f->offset   = strtoull(p, &p, 10);
+      f->lines    = (size_t)strtoull(p, &p, 10);
+      f->reuse    = -1;
+      if (*p++ != ' ' || f->dir < 0 || f->dir >= m->dir_count) return -1;
+      f->name = p;
+      m->file_count++;
+    } else {
+      return -1;
+    }
   }
+  qsort(m->files, m->file_count, sizeof(Segment), compare_segments);
+  return 0;
+}
 
-  /* 5. Execute */
-  if (cmd == CMD_WRITE) {
-    if (file_exists(full_path) && !force) {
-      fprintf(stderr, SGR_RED "Error:" SGR_RESET " File exists. Use -f to overwrite.\n");
-      if (alloc_content) free(input_content);
-      free(full_path);
-      return EXIT_FAILURE;
+static void manifest_free(Manifest *m) {
+  free(m->text);
+  free(m->files);
+  memset(m, 0, sizeof(*m));
+}
+
+/**
+ * Checks every directory and file of a parsed manifest against the
+ * filesystem, counting the files, their bytes and the syscalls spent into
+ * stats. Returns 0 if everything still matches, -1 otherwise.
+ */
+static int manifest_matches(const Manifest *m, LoadStats *stats) {
+  int dir_fds[CACHE_MAX_DIRS];
+  int dir_count = 0;
+  int rc        = -1;
+
+  for (; dir_count < m->dir_count; dir_count++) {
+    struct stat st;
+    int fd = open(m->dirs[dir_count], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stats->syscalls += 2;
+    if (fd < 0) goto done;
+    dir_fds[dir_count] = fd;
+    if (fstat(fd, &st) != 0 || stat_mtime_ns(&st) != m->dir_mtimes[dir_count]) {
+      dir_count++;
+      goto done;
     }
-    fp = fopen(full_path, "w");
-    if (!fp) perror("fopen");
-    else { fputs(input_content, fp); fclose(fp); if (!quiet) printf("%s\n", filename); }
+  }
 
-  } else if (cmd == CMD_APPEND) {
-    fp = fopen(full_path, "a");
-    if (!fp) perror("fopen");
-    else { fprintf(fp, "\n%s", input_content); fclose(fp); if (!quiet) printf("%s\n", filename); }
+  for (size_t i = 0; i < m->file_count; i++) {
+    const Segment *f = &m->files[i];
+    struct stat    st;
 
-  } else if (cmd == CMD_REMOVE) {
-    if (unlink(full_path) != 0) perror("unlink");
+    stats->syscalls++;
+    if (fstatat(dir_fds[f->dir], f->name, &st, 0) != 0 || (uint64_t)st.st_ino != f->ino ||
+        (uint64_t)st.st_size != f->size || stat_mtime_ns(&st) != f->mtime_ns) goto done;
+    stats->files++;
+    stats->bytes += (size_t)f->size;
   }
+  rc = 0;
 
-  if (alloc_content) free(input_content);
-  free(full_path);
-  return EXIT_SUCCESS;
+done:
+  for (int i = 0; i < dir_count; i++) close(dir_fds[i]);
+  return rc;
 }
 
-/* =========================================================================
- * Low-level utilities
- * ====================================================================== */
+/**
+ * Serves the cached bundle to out if its manifest still matches.
+ * Returns 0 when served, 1 on a miss (nothing written), -1 if writing
+ * the cached bytes failed. On a miss, a previous bundle that agrees with
+ * its manifest stays open in c->old_fd so unchanged bodies can be reused.
+ */
+static int cache_serve(BundleCache *c, Emitter *out, LoadStats *stats) {
+  size_t       text_size = 0;
+  unsigned int reads     = 0;
+  struct stat  st;
+
+  /* A second lookup, after waiting for another rebuild, starts afresh */
+  if (c->old_fd >= 0) close(c->old_fd);
+  c->old_fd = -1;
+  manifest_free(&c->old);
+
+  /* Open the bundle first: if it is replaced meanwhile, the inode check fails */
+  c->seen_ino = 0;
+  int fd = open(c->bundle_path, O_RDONLY | O_CLOEXEC);
+  stats->syscalls++;
+  if (fd < 0) return 1;
+  if (fstat(fd, &st) == 0) c->seen_ino = (uint64_t)st.st_ino;
+
+  int   mfd  = open(c->manifest_path, O_RDONLY | O_CLOEXEC);
+  char *text = NULL;
+  stats->syscalls += 5;
+  if (mfd >= 0 && fstat(mfd, &st) == 0)
+    text = read_open_file(mfd, c->dir, find_last_path_separator(c->manifest_path) + 1,
+                          (size_t)st.st_size, &text_size, &reads);
+  if (mfd >= 0) close(mfd);
+  stats->syscalls += reads;
+
+  if (!text || manifest_parse(text, &c->old) != 0 || fstat(fd, &st) != 0 ||
+      (uint64_t)st.st_ino != c->old.bundle_ino || (uint64_t)st.st_size != c->old.bundle_size) {
+    manifest_free(&c->old);
+    close(fd);
+    return 1;
+  }
 
-static const char *find_last_path_separator(const char *path) {
-  const char *fwd  = strrchr(path, '/');
-  const char *back = strrchr(path, '\\');
-  if (!fwd)  return back;
-  if (!back) return fwd;
-  return (fwd > back) ? fwd : back;
-}
+  if (manifest_matches(&c->old, stats) == 0) {
+    int rc = emit_file(out, fd, 0, (size_t)st.st_size) == 0 ? 0 : -1;
+    manifest_free(&c->old);
+    close(fd);
+    return rc;
+  }
 
-static int extract_order_number(const char *filename) {
-  if (strncmp(filename, "ordered.", 8) != 0) return -1;
-  char *endptr;
-  long num = strtol(filename + 8, &endptr, 10);
-  if (endptr == filename + 8 || num < 0 || num > INT_MAX) return -1;
-  return (int)num;
+  stats->files = 0;
+  stats->bytes = 0;
+  c->old_fd    = fd;
+  return 1;
 }
 
-/* Returns a pointer to the suffix of an ordered filename — the part after
- * "ordered.<digits>." — so that same-group files sort by intended name
- * rather than by digit formatting (e.g. "001" vs "01" vs "1").
- * For non-ordered filenames, returns the full name unchanged. */
-static const char *extract_suffix(const char *filename) {
-  if (strncmp(filename, "ordered.", 8) != 0) return filename;
-  const char *p = filename + 8;
-  while (isdigit((unsigned char)*p)) p++;
-  return (*p == '.') ? p + 1 : p;
+/**
+ * Serves the cached bundle without looking at a single script, provided
+ * its manifest was written or revalidated at most max_stale seconds ago.
+ * Returns 0 when served, 1 when there is no such entry, -1 if writing the
+ * cached bytes failed.
+ */
+static int cache_serve_stale(BundleCache *c, Emitter *out, unsigned int max_stale,
+                             LoadStats *stats) {
+  Manifest        m;
+  size_t          text_size = 0;
+  unsigned int    reads     = 0;
+  char           *text      = NULL;
+  struct stat     st;
+  struct timespec now;
+  int             rc        = 1;
+
+  memset(&m, 0, sizeof(m));
+  int fd = open(c->bundle_path, O_RDONLY | O_CLOEXEC);
+  stats->syscalls++;
+  if (fd < 0) return 1;
+
+  int mfd = open(c->manifest_path, O_RDONLY | O_CLOEXEC);
+  clock_gettime(CLOCK_REALTIME, &now);
+  stats->syscalls += 3;
+  if (mfd >= 0 && fstat(mfd, &st) == 0 && st.st_mtime <= now.tv_sec &&
+      now.tv_sec - st.st_mtime <= (time_t)max_stale)
+    text = read_open_file(mfd, c->dir, find_last_path_separator(c->manifest_path) + 1,
+                          (size_t)st.st_size, &text_size, &reads);
+  if (mfd >= 0) close(mfd);
+  stats->syscalls += reads;
+
+  /* The inode check still pairs this manifest with this bundle */
+  if (text && manifest_parse(text, &m) == 0 && fstat(fd, &st) == 0 &&
+      (uint64_t)st.st_ino == m.bundle_ino && (uint64_t)st.st_size == m.bundle_size) {
+    for (size_t i = 0; i < m.file_count; i++) stats->bytes += (size_t)m.files[i].size;
+    stats->files = m.file_count;
+    rc = emit_file(out, fd, 0, (size_t)st.st_size) == 0 ? 0 : -1;
+  }
+  manifest_free(&m);
+  close(fd);
+  return rc;
 }
 
-static int compare_ordered_files(const void *a, const void *b) {
-  const FileEntry *fa = (const FileEntry *)a;
-  const FileEntry *fb = (const FileEntry *)b;
-  if (fa->order_num != fb->order_num) return fa->order_num - fb->order_num;
-  return strcmp(extract_suffix(fa->name), extract_suffix(fb->name));
-}
+/**
+ * Forks a detached revalidation after a stale entry was served. Returns 1
+ * in the detached process, which runs in its own session with stdio on
+ * /dev/null so the reading shell sees EOF at once, and 0 in the caller.
+ * The intermediate child exits immediately, leaving nothing to reap.
+ */
+static int detach_revalidation(void) {
+  pid_t pid = fork();
+  if (pid < 0) return 0;
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+    return 0;
+  }
 
-static int compare_unordered(const void *a, const void *b) {
-  const FileEntry *fa = (const FileEntry *)a;
-  const FileEntry *fb = (const FileEntry *)b;
-  if (fa->order_num != fb->order_num) return fa->order_num - fb->order_num;
-  return strcmp(fa->name, fb->name);
+  if (fork() != 0) _exit(0);
+  setsid();
+  int null = open("/dev/null", O_RDWR);
+  if (null >= 0) {
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    if (null > STDERR_FILENO) close(null);
+  }
+  return 1;
 }
 
-static char *read_file_contents(const char *directory, const char *filename, size_t *size) {
-  char filepath[PATH_MAX];
-  snprintf(filepath, sizeof(filepath), "%s/%s", directory, filename);
+/**
+ * Takes the entry's rebuild lock, so concurrent shells rebuild a stale
+ * entry once between them. Returns 0 when the lock was free, 2 after
+ * waiting for another process to release it (when wait is set) or when a
+ * free lock was taken after another process published the entry since it
+ * was looked up, 1 when it is held elsewhere and wait is not set, and -1
+ * if locking is unavailable; the caller then rebuilds unlocked.
+ */
+static int cache_lock(BundleCache *c, Boolean wait) {
+  struct stat st;
 
-  FILE *file = fopen(filepath, "r");
-  if (!file) {
-    fprintf(stderr, "Error opening file '%s': %s\n", filepath, strerror(errno));
-    return NULL;
+  if (make_dirs(c->dir) != 0) return -1;
+  c->lock_fd = open(c->lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (c->lock_fd < 0) return -1;
+  if (flock(c->lock_fd, LOCK_EX | LOCK_NB) == 0) {
+    /* The rebuild may have finished between the lookup and this lock */
+    if (stat(c->bundle_path, &st) == 0 && (uint64_t)st.st_ino != c->seen_ino) return 2;
+    return 0;
   }
 
-  struct stat st;
-  if (stat(filepath, &st) != 0) {
-    fprintf(stderr, "Error getting file size for '%s': %s\n", filepath, strerror(errno));
-    fclose(file);
-    return NULL;
+  if (errno == EWOULDBLOCK && !wait) {
+    cache_unlock(c);
+    return 1;
   }
+  if (errno == EWOULDBLOCK) {
+    int rc;
+    while ((rc = flock(c->lock_fd, LOCK_EX)) != 0 && errno == EINTR) {}
+    if (rc == 0) return 2;
+  }
+  cache_unlock(c);
+  return -1;
+}
 
-  char *contents = malloc((size_t)st.st_size + 1);
-  if (!contents) {
-    fprintf(stderr, "Error allocating memory for file '%s'\n", filepath);
-    fclose(file);
-    return NULL;
+/* Releases the rebuild lock, if held. */
+static void cache_unlock(BundleCache *c) {
+  if (c->lock_fd >= 0) close(c->lock_fd);
+  c->lock_fd = -1;
+}
+
+/**
+ * Starts a cache entry: creates the cache directory and a temporary
+ * bundle file beside the final one. Returns its fd, or -1.
+ */
+static int cache_begin(BundleCache *c) {
+  if (make_dirs(c->dir) != 0) return -1;
+  if (snprintf(c->temp_path, sizeof(c->temp_path), "%s.XXXXXX", c->bundle_path) >= (int)sizeof(c->temp_path)) {
+    c->temp_path[0] = '\0';
+    errno = ENAMETOOLONG;
+    return -1;
   }
+  int fd = mkstemp(c->temp_path);
+  if (fd < 0) c->temp_path[0] = '\0';
+  return fd;
+}
 
-  size_t bytes_read = fread(contents, 1, (size_t)st.st_size, file);
-  if (bytes_read != (size_t)st.st_size) {
-    fprintf(stderr, "Error reading file '%s': %s\n", filepath, strerror(errno));
-    free(contents);
-    fclose(file);
-    return NULL;
+/**
+ * Records the directory mtimes (taken before scanning) and the metadata
+ * of every file about to be bundled, one segment per file in bundle
+ * order. Runs before any file is read, so a file edited mid-bundle leaves
+ * a manifest that no longer matches. A file whose metadata equals its
+ * record in the previous manifest is marked for reuse: its body is copied
+ * from the old bundle instead of being read again.
+ * Returns -1 if some file cannot be described; the entry is then dropped.
+ */
+static int cache_record_sources(BundleCache *c, const BundleSource *sources, int count) {
+  size_t cap   = 4096;
+  size_t len   = 0;
+  size_t total = 0;
+  int    old_dir[CACHE_MAX_DIRS];
+  char  *buf   = malloc(cap);
+
+  for (int s = 0; s < count; s++) total += sources[s].sd.count;
+  c->segments = malloc((total ? total : 1) * sizeof(Segment));
+  if (!buf || !c->segments) goto fail;
+
+  for (int s = 0; s <= count; s++) {
+    const char *path  = s < count ? sources[s].path     : c->base_path;
+    int64_t     mtime = s < count ? sources[s].mtime_ns : c->base_mtime_ns;
+    char        real[PATH_MAX];
+
+    if (s == count && !c->base_path[0]) break;
+    if (mtime > c->newest_dir_ns) c->newest_dir_ns = mtime;
+    if (s < count && !realpath(path, real)) goto fail;
+
+    const char *shown = s < count ? real : path;
+    size_t      need  = strlen(shown) + 32;
+    if (len + need > cap) {
+      char *grown = realloc(buf, cap = (len + need) * 2);
+      if (!grown) goto fail;
+      buf = grown;
+    }
+    len += (size_t)snprintf(buf + len, cap - len, "D %lld %s\n", (long long)mtime, shown);
+
+    /* The same directory may sit at another index in the old manifest */
+    if (s < count) {
+      old_dir[s] = -1;
+      for (int d = 0; d < c->old.dir_count; d++)
+        if (strcmp(c->old.dirs[d], real) == 0) old_dir[s] = d;
+    }
   }
 
-  contents[bytes_read] = '\0';
-  *size = bytes_read;
-  fclose(file);
-  return contents;
-}
+  for (int s = 0; s < count; s++) {
+    const SortedDir *sd = &sources[s].sd;
+    for (size_t i = 0; i < sd->count; i++) {
+      Segment    *seg = &c->segments[c->segment_count++];
+      struct stat st;
+
+      memset(seg, 0, sizeof(*seg));
+      seg->name  = entry_name(sd, &sd->entries[i]);
+      seg->dir   = s;
+      seg->reuse = -1;
+      if (strchr(seg->name, '\n') || fstatat(sd->dir_fd, seg->name, &st, 0) != 0) goto fail;
+      seg->ino      = (uint64_t)st.st_ino;
+      seg->size     = (uint64_t)st.st_size;
+      seg->mtime_ns = stat_mtime_ns(&st);
+
+      if (old_dir[s] < 0 || c->old_fd < 0) continue;
+      Segment  key  = { seg->name, old_dir[s], 0, 0, 0, 0, 0, -1 };
+      Segment *prev = bsearch(&key, c->old.files, c->old.file_count, sizeof(Segment), compare_segments);
+      if (prev && prev->ino == seg->ino && prev->size == seg->size &&
+          prev->mtime_ns == seg->mtime_ns && prev->offset + prev->size <= c->old.bundle_size) {
+        seg->reuse = (int64_t)prev->offset;
+        seg->lines = prev->lines;
+      }
+    }
+  }
+
+  c->dir_lines     = buf;
+  c->dir_lines_len = len;
+  return 0;
 
-static char *ensure_buffer_capacity(char *buffer, size_t *capacity, size_t needed) {
-  if (needed <= *capacity) return buffer;
+fail:
+  free(buf);
+  free(c->segments);
+  c->segments      = NULL;
+  c->segment_count = 0;
+  return -1;
+}
 
-  size_t new_capacity = *capacity;
-  while (new_capacity < needed) new_capacity *= 2;
+/**
+ * Publishes the finished temporary bundle: writes the manifest beside it,
+ * then renames the bundle into place followed by the manifest. A reader
+ * that sees the new bundle with the old manifest fails the inode check.
+ *
+ * The bundle's mtime is set just past the newest directory mtime it was
+ * built from, so a startup hook's [[ bundle -nt dir ]] holds exactly
+ * until one of those directories changes again.
+ */
+static int cache_publish(BundleCache *c, int fd) {
+  char        manifest_temp[PATH_MAX];
+  struct stat st;
+  int         rc = -1;
 
-  char *nb = realloc(buffer, new_capacity);
-  if (!nb) {
-    fprintf(stderr, "Failed to reallocate buffer to %zu bytes\n", new_capacity);
-    free(buffer);
-    return NULL;
+  if (!c->segments || fstat(fd, &st) != 0) return -1;
+  if (snprintf(manifest_temp, sizeof(manifest_temp), "%s.XXXXXX", c->manifest_path) >= (int)sizeof(manifest_temp))
+    return -1;
+  int mfd = mkstemp(manifest_temp);
+  if (mfd < 0) return -1;
+
+  /* The manifest goes out through an emitter too, in batched writev() calls */
+  Emitter em;
+  emit_init(&em, mfd);
+  int ok = (emit_text(&em, MANIFEST_MAGIC "\nB %llu %llu\n%s",
+                      (unsigned long long)st.st_ino, (unsigned long long)st.st_size,
+                      c->dir_lines) == 0);
+  for (size_t i = 0; ok && i < c->segment_count; i++) {
+    const Segment *seg = &c->segments[i];
+    ok = (emit_text(&em, "F %d %llu %llu %lld %llu %zu %s\n", seg->dir,
+                    (unsigned long long)seg->ino, (unsigned long long)seg->size,
+                    (long long)seg->mtime_ns, (unsigned long long)seg->offset,
+                    seg->lines, seg->name) == 0);
   }
+  ok = (emit_flush(&em) == 0 && ok);
 
-  *capacity = new_capacity;
-  return nb;
+  struct timespec stamp[2];
+  stamp[0].tv_sec  = (time_t)((c->newest_dir_ns + 1) / 1000000000);
+  stamp[0].tv_nsec = (long)((c->newest_dir_ns + 1) % 1000000000);
+  stamp[1]         = stamp[0];
+  if (ok && c->newest_dir_ns > 0 && futimens(fd, stamp) != 0) ok = 0;
+
+  if (ok && rename(c->temp_path, c->bundle_path) == 0) {
+    c->temp_path[0] = '\0';
+    rc = rename(manifest_temp, c->manifest_path);
+  }
+  close(mfd);
+  if (rc != 0) unlink(manifest_temp);
+  return rc;
 }
 
-static size_t count_lines(const char *content, size_t size) {
-  size_t count = 0;
-  for (size_t i = 0; i < size; i++)
-    if (content[i] == '\n') count++;
-  if (size > 0 && content[size - 1] != '\n') count++;
-  return count;
+/* Drops an unpublished entry and releases everything the cache holds. */
+static void cache_close(BundleCache *c) {
+  if (c->temp_path[0]) unlink(c->temp_path);
+  c->temp_path[0] = '\0';
+  cache_unlock(c);
+  if (c->old_fd >= 0) close(c->old_fd);
+  c->old_fd = -1;
+  manifest_free(&c->old);
+  free(c->dir_lines);
+  free(c->segments);
+  c->dir_lines = NULL;
+  c->segments  = NULL;
 }
 
 /* =========================================================================
@@ -978,6 +5152,17 @@ static char *read_stdin_to_buffer(void) {
   return buffer;
 }
 
+/* Sets the mtime of the directory holding path to now. */
+static void touch_parent_dir(const char *path) {
+  const char *sep = find_last_path_separator(path);
+  char        dir[PATH_MAX];
+
+  if (!sep || (size_t)(sep - path) >= sizeof(dir)) return;
+  memcpy(dir, path, (size_t)(sep - path));
+  dir[sep - path] = '\0';
+  if (utimensat(AT_FDCWD, dir[0] ? dir : "/", NULL, 0) != 0) perror("utimensat");
+}
+
 static char *build_path(const char *sub_dir, const char *filename) {
   const char *base = getenv("SCRIPTSORT_DIR");
   const char *home = getenv("HOME");
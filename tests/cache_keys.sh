@@ -0,0 +1,89 @@
+#!/usr/bin/env bash
+#
+# Checks that bundle --cache, hook and serve find the same cache entry and
+# daemon socket for one scripts directory, however it is spelled: relative,
+# with a trailing slash, absolute, or through a symlink to it.
+#
+# Usage: tests/cache_keys.sh [scriptsort binary]
+
+SCRIPTSORT=${1:-.local/bin/scriptsort}
+
+if [[ ! -x ${SCRIPTSORT} ]]; then
+  printf "\x1b[31m%s is not an executable, run ./build.sh first\x1b[39m\n" "${SCRIPTSORT}"
+  exit 2
+fi
+SCRIPTSORT=$(cd "$(dirname "${SCRIPTSORT}")" && pwd)/$(basename "${SCRIPTSORT}")
+
+WORK=$(mktemp -d) || exit 2
+SERVER=
+trap '[[ -n ${SERVER} ]] && kill "${SERVER}" 2> /dev/null; rm -rf "${WORK}"' EXIT
+
+export XDG_CACHE_HOME="${WORK}/cache"
+export XDG_RUNTIME_DIR="${WORK}/run"
+mkdir -p "${WORK}/dotfiles/scripts/shared" "${WORK}/dotfiles/scripts/bash" "${XDG_RUNTIME_DIR}"
+chmod 700 "${XDG_RUNTIME_DIR}"
+printf "export A=1\n" > "${WORK}/dotfiles/scripts/shared/a.sh"
+printf "export B=1\n" > "${WORK}/dotfiles/scripts/bash/b.sh"
+ln -s dotfiles/scripts "${WORK}/link"
+cd "${WORK}" || exit 2
+
+FAILED=0
+fail() {
+  printf "\x1b[31m%s\x1b[39m\n" "$1"
+  FAILED=1
+}
+
+# The entry bundle --cache writes, and the one hook's snippet sources
+entry_of_bundle() {
+  rm -rf "${XDG_CACHE_HOME}"
+  "${SCRIPTSORT}" bundle -s "$1" --bash --cache --no-daemon > /dev/null
+  basename "$(ls "${XDG_CACHE_HOME}"/scriptsort/*.sh)"
+}
+entry_of_hook() {
+  "${SCRIPTSORT}" hook -s "$1" --bash | grep -o "[0-9a-f]\{16\}\.sh" | sort -u
+}
+
+for dir in link link/ ./link "${WORK}/link" "${WORK}//link/."; do
+  bundled=$(entry_of_bundle "${dir}")
+  hooked=$(entry_of_hook "${dir}")
+  if [[ -z ${bundled} || ${bundled} != "${hooked}" ]]; then
+    fail "-s ${dir}: bundle --cache wrote '${bundled}', hook sources '${hooked}'"
+  fi
+done
+
+for dir in dotfiles/scripts dotfiles/scripts/ "${WORK}/dotfiles/scripts"; do
+  bundled=$(entry_of_bundle "${dir}")
+  hooked=$(entry_of_hook "${dir}")
+  if [[ -z ${bundled} || ${bundled} != "${hooked}" ]]; then
+    fail "-s ${dir}: bundle --cache wrote '${bundled}', hook sources '${hooked}'"
+  fi
+done
+
+# The snippet's fallback must rebuild the very entry the snippet tests
+rm -rf "${XDG_CACHE_HOME}"
+snippet=$("${SCRIPTSORT}" hook -s link --bash)
+mkdir -p "${WORK}/bin"
+ln -s "${SCRIPTSORT}" "${WORK}/bin/scriptsort"
+PATH="${WORK}/bin:${PATH}" bash -c "${snippet}" > /dev/null 2>&1
+if [[ ! -f ${XDG_CACHE_HOME}/scriptsort/$(entry_of_hook link) ]]; then
+  fail "hook -s link: the snippet's fallback did not create the entry it tests"
+fi
+
+# A daemon started through the symlink serves bundles asked for through it
+if [[ $(uname) == Linux ]]; then
+  "${SCRIPTSORT}" serve -s link --bash 2> /dev/null &
+  SERVER=$!
+  for _ in $(seq 1 50); do
+    ls "${XDG_RUNTIME_DIR}"/scriptsort/*.sock > /dev/null 2>&1 && break
+    sleep 0.1
+  done
+  stats=$("${SCRIPTSORT}" bundle -s link --bash --stats 2>&1 > /dev/null)
+  if [[ ${stats} != *cache=daemon* ]]; then
+    fail "serve -s link: bundle -s link did not reach the daemon (${stats})"
+  fi
+fi
+
+if [[ ${FAILED} -ne 0 ]]; then
+  exit 1
+fi
+printf "cache keys agree across spellings and symlinks: ok\n"
@@ -0,0 +1,78 @@
+#!/usr/bin/env bash
+#
+# Stress test for the bundle cache's single-flight rebuild.
+#
+# Makes a cache entry stale, starts many `scriptsort bundle --cache` at once
+# against it and checks that every one of them printed the same bundle as an
+# uncached run, and that exactly one of them rebuilt the entry while the
+# others waited on its lock and served what it published.
+#
+# Usage: tests/stress_cache.sh [scriptsort binary] [processes] [rounds]
+
+SCRIPTSORT=${1:-.local/bin/scriptsort}
+PROCESSES=${2:-32}
+ROUNDS=${3:-20}
+
+if [[ ! -x ${SCRIPTSORT} ]]; then
+  printf "\x1b[31m%s is not an executable, run ./build.sh first\x1b[39m\n" "${SCRIPTSORT}"
+  exit 2
+fi
+
+WORK=$(mktemp -d) || exit 2
+trap 'rm -rf "${WORK}"' EXIT
+
+export XDG_CACHE_HOME="${WORK}/cache"
+SCRIPTS="${WORK}/scripts"
+mkdir -p "${SCRIPTS}/shared" "${SCRIPTS}/bash"
+
+for i in $(seq 1 200); do
+  printf "alias s%d='echo %d'\nfunction f%d() {\n  return 0\n}\n" "${i}" "${i}" "${i}" > "${SCRIPTS}/shared/${i}.sh"
+done
+for i in $(seq 1 20); do
+  printf "export B%d=%d\n" "${i}" "${i}" > "${SCRIPTS}/bash/${i}.sh"
+done
+
+bundle() {
+  "${SCRIPTSORT}" bundle -s "${SCRIPTS}" --bash --no-daemon "$@"
+}
+
+if ! bundle --cache > /dev/null; then
+  printf "\x1b[31mcould not create the cache entry\x1b[39m\n"
+  exit 1
+fi
+
+FAILED=0
+for round in $(seq 1 "${ROUNDS}"); do
+  # Change a file's size so the entry is stale for every process below
+  printf "export ROUND=%d\n" "${round}" >> "${SCRIPTS}/shared/$((round % 200 + 1)).sh"
+  bundle > "${WORK}/expected"
+
+  for p in $(seq 1 "${PROCESSES}"); do
+    bundle --cache --stats > "${WORK}/out.${p}" 2> "${WORK}/err.${p}" &
+  done
+  wait
+
+  misses=0
+  for p in $(seq 1 "${PROCESSES}"); do
+    if ! cmp -s "${WORK}/expected" "${WORK}/out.${p}"; then
+      printf "\x1b[31mround %d: process %d printed a different bundle\x1b[39m\n" "${round}" "${p}"
+      FAILED=1
+    fi
+    if grep -q "cache=miss" "${WORK}/err.${p}"; then
+      misses=$((misses + 1))
+    elif ! grep -q "cache=hit" "${WORK}/err.${p}"; then
+      printf "\x1b[31mround %d: process %d failed:\x1b[39m\n" "${round}" "${p}"
+      cat "${WORK}/err.${p}"
+      FAILED=1
+    fi
+  done
+  if [[ ${misses} -ne 1 ]]; then
+    printf "\x1b[31mround %d: %d rebuilds instead of 1\x1b[39m\n" "${round}" "${misses}"
+    FAILED=1
+  fi
+done
+
+if [[ ${FAILED} -ne 0 ]]; then
+  exit 1
+fi
+printf "%d rounds of %d concurrent bundles: ok\n" "${ROUNDS}" "${PROCESSES}"